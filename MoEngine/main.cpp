@@ -1,12 +1,54 @@
+// timeBeginPeriod for the frame limiter, before glad so windows.h gets to define APIENTRY first
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <mmsystem.h>
+#undef near // Leftovers from 16-bit Windows that would eat our projection's parameter names
+#undef far
+#endif
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <string>
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <cctype>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <ctime>
+#include <thread>
+#include <cmath>
+#include <mutex>
+#include <condition_variable>
 
 using namespace std;
 
+// Profiler switch, build with MO_PROFILER=0 to compile every zone out
+#ifndef MO_PROFILER
+#define MO_PROFILER 1
+#endif
+
+#ifdef __linux__
+#include <time.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <map>
+#include <vector>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#endif
+
 // Settings
 // Functions to allow us to setup OpenGL to be run as a library
 unsigned int scrWidth = 800;
@@ -31,10 +73,22 @@ struct vec2d {
 	float y;
 };
 
+// RGBA colour, also stored consecutively so it can go straight into a VBO
+struct rgba {
+	float r;
+	float g;
+	float b;
+	float a;
+};
+
 // Public offsets to change with screen size changes
 vec2d paddleOffsets[2];
 vec2d pongOffset;
 
+// Colours, these go in the instance stream so changing them is free
+rgba paddleColors[2] = { { 1.0f, 1.0f, 1.0f, 1.0f }, { 1.0f, 1.0f, 1.0f, 1.0f } };
+rgba pongColor = { 1.0f, 1.0f, 1.0f, 1.0f };
+
 // Public array for moving the pong ball and paddles
 float paddleVelocity[2]; // we only care about the y axis
 vec2d pongVelocityInitial = { 200.0f, 200.0f };
@@ -46,22 +100,42 @@ unsigned int rightScore = 0;
 
 // Pause game vvariable
 bool pauseMe = false;
-bool pausePressed = false;
 float gameSpeed = 1.0f;
 
+// Which actions were down this frame, 8 bits per player (filled in from gatherInput)
+unsigned int actionsDown = 0;
+
+// Something changed that isn't in the game state (input, resize...) so the next frame has to be drawn
+bool redrawRequested = true;
+
+// Dump this frame's render commands to a file (F12)
+bool dumpCommandsRequested = false;
+
+// Dump the profiler trace for the last few seconds (F11)
+bool dumpTraceRequested = false;
+const unsigned int traceDumpFrames = 300;
+
 // I know this isn't the best but I just wanted to simplify it for my brain so I can
 // Acces this in some callbacks (such as reshaping the orth projection)
 GLuint shaderProgram;
 
 // Initialize the GLFW
-void initGLFW(unsigned int versionMajor, unsigned int versionMinor) {
+// headlessContextApi (GLFW_OSMESA_CONTEXT_API or GLFW_EGL_CONTEXT_API) uses GLFW's null platform,
+// so there's no display needed and the "window" is just a context (see Headless)
+void initGLFW(unsigned int versionMajor, unsigned int versionMinor, int headlessContextApi = 0) {
 
+	if (headlessContextApi) {
+		glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+	}
 	glfwInit();
 
 	// Window Params
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, versionMajor);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, versionMinor);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	if (headlessContextApi) {
+		glfwWindowHint(GLFW_CONTEXT_CREATION_API, headlessContextApi);
+	}
 
 	// Mac stuff thx u apple
 #ifdef __APPLE__
@@ -90,6 +164,441 @@ bool loadGlad() {
 
 }
 
+//
+// Profiler
+//
+
+// Each thread writes the zones it finishes into its own ring buffer, so recording
+// never takes a lock. Only the owning thread writes a ring, and the head only ever
+// goes up, so whoever dumps the trace can read it without stopping anybody.
+// Zones are tagged with the frame they ended in so we can dump any recent frame range.
+
+// Nanoseconds on a monotonic clock
+uint64_t profilerNow() {
+#ifdef __linux__
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#else
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+#if MO_PROFILER
+
+// Hardware counters
+// With perf counters turned on (--perf-counters, Linux only) every zone also reads the
+// CPU's counters when it opens and closes, so each zone knows how many cycles,
+// instructions, cache misses and branch misses it cost. Each read is a syscall
+// (around a microsecond) so it's off by default. The Linux build command is under
+// Sampling Profiler.
+enum PerfCounter {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_L1D_MISSES,
+	PERF_LLC_MISSES,
+	PERF_BRANCH_MISSES,
+	noPerfCounters
+};
+
+const char* perfCounterNames[noPerfCounters] = { "cycles", "instructions", "l1dMisses", "llcMisses", "branchMisses" };
+
+bool perfCountersEnabled = false;
+
+// One thread's counters, opened as a group so they're all read at once
+struct PerfCounterGroup {
+	bool tried;
+	int leader;
+	int fds[noPerfCounters];
+	int slot[noPerfCounters]; // Where each counter lands in a group read (-1 if it couldn't be opened)
+	unsigned int noOpen;
+};
+
+void openPerfCounters(PerfCounterGroup& group) {
+	group.tried = true;
+	group.leader = -1;
+	group.noOpen = 0;
+
+	for (unsigned int c = 0; c < noPerfCounters; c++) {
+		group.fds[c] = -1;
+		group.slot[c] = -1;
+	}
+
+#ifdef __linux__
+	const uint32_t types[noPerfCounters] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE };
+	const uint64_t configs[noPerfCounters] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		PERF_COUNT_HW_CACHE_MISSES,
+		PERF_COUNT_HW_BRANCH_MISSES
+	};
+
+	for (unsigned int c = 0; c < noPerfCounters; c++) {
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = types[c];
+		attr.config = configs[c];
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		// Counts this thread on whatever CPU it's on
+		int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, group.leader, 0);
+		if (fd < 0) {
+			continue;
+		}
+
+		if (group.leader == -1) {
+			group.leader = fd;
+		}
+		group.fds[c] = fd;
+		group.slot[c] = group.noOpen++;
+	}
+#endif
+
+	if (group.noOpen == 0) {
+		cout << "Hardware counters are not available on this thread" << endl;
+	}
+}
+
+// Current value of every counter (0 for any we don't have)
+void readPerfCounters(PerfCounterGroup& group, uint64_t* values) {
+	memset(values, 0, noPerfCounters * sizeof(uint64_t));
+
+#ifdef __linux__
+	if (group.leader == -1) {
+		return;
+	}
+
+	uint64_t data[1 + noPerfCounters]; // Number of counters, then each value
+	if (read(group.leader, data, sizeof(data)) <= 0) {
+		return;
+	}
+
+	for (unsigned int c = 0; c < noPerfCounters; c++) {
+		if (group.slot[c] != -1) {
+			values[c] = data[1 + group.slot[c]];
+		}
+	}
+#endif
+}
+
+void closePerfCounters(PerfCounterGroup& group) {
+#ifdef __linux__
+	for (unsigned int c = 0; c < noPerfCounters; c++) {
+		if (group.fds[c] != -1) {
+			close(group.fds[c]);
+		}
+	}
+#endif
+	group.leader = -1;
+}
+
+struct ProfileZone {
+	const char* name; // Has to be a string literal (or live forever)
+	uint64_t start;
+	uint64_t end;
+	unsigned int depth;
+	unsigned int frame;
+	uint64_t counters[noPerfCounters]; // All 0 unless perf counters are on
+};
+
+const unsigned int profilerRingSize = 1 << 16; // Per thread, must be a power of 2
+const unsigned int maxProfilerThreads = 16;
+
+struct ProfilerThread {
+	ProfileZone zones[profilerRingSize];
+	atomic<uint64_t> head; // Number of zones ever written
+	unsigned int depth; // How many zones are open right now
+	unsigned int id;
+	const char* name;
+
+	// Zones opened with profilerBegin waiting for their profilerEnd
+	const char* openNames[64];
+	uint64_t openStarts[64];
+	uint64_t openCounters[64][noPerfCounters];
+
+	PerfCounterGroup perf;
+};
+
+ProfilerThread* profilerThreads[maxProfilerThreads];
+atomic<unsigned int> noProfilerThreads(0);
+thread_local ProfilerThread* profilerThread = nullptr;
+atomic<unsigned int> profilerFrame(0);
+
+// Make a new track in the trace, normally one per thread but things like the GPU get one too
+// Returns nullptr if we've run out of slots
+ProfilerThread* profilerNewTrack(const char* name) {
+	unsigned int id = noProfilerThreads.fetch_add(1);
+	if (id >= maxProfilerThreads) {
+		return nullptr;
+	}
+
+	ProfilerThread* t = new ProfilerThread;
+	t->head.store(0);
+	t->depth = 0;
+	t->id = id;
+	t->name = name;
+	t->perf.tried = false;
+	t->perf.leader = -1;
+	profilerThreads[id] = t;
+	return t;
+}
+
+// Get this thread's ring, making it the first time the thread records something
+ProfilerThread* profilerGetThread() {
+	if (!profilerThread) {
+		profilerThread = profilerNewTrack("thread");
+	}
+
+	return profilerThread;
+}
+
+void profilerSetThreadName(const char* name) {
+	ProfilerThread* t = profilerGetThread();
+	if (t) {
+		t->name = name;
+	}
+}
+
+// Only the thread that owns the track should call this
+// counters is how much each perf counter went up during the zone (or nullptr)
+void profilerRecord(ProfilerThread* t, const char* name, uint64_t start, uint64_t end, unsigned int depth, unsigned int frame, const uint64_t* counters = nullptr) {
+	uint64_t head = t->head.load(memory_order_relaxed);
+	ProfileZone& zone = t->zones[head & (profilerRingSize - 1)];
+	zone.name = name;
+	zone.start = start;
+	zone.end = end;
+	zone.depth = depth;
+	zone.frame = frame;
+	for (unsigned int c = 0; c < noPerfCounters; c++) {
+		zone.counters[c] = counters ? counters[c] : 0;
+	}
+	t->head.store(head + 1, memory_order_release);
+}
+
+// Read this thread's counters if they're on
+void profilerReadCounters(ProfilerThread* t, uint64_t* values) {
+	if (!t->perf.tried) {
+		openPerfCounters(t->perf);
+	}
+	readPerfCounters(t->perf, values);
+}
+
+// Record a zone that just ended on this thread, counterStart is what the counters were when it opened
+void profilerEndZone(ProfilerThread* t, const char* name, uint64_t start, const uint64_t* counterStart) {
+	uint64_t end = profilerNow();
+	unsigned int frame = profilerFrame.load(memory_order_relaxed);
+
+	if (perfCountersEnabled) {
+		uint64_t counters[noPerfCounters];
+		profilerReadCounters(t, counters);
+		for (unsigned int c = 0; c < noPerfCounters; c++) {
+			counters[c] -= counterStart[c];
+		}
+		profilerRecord(t, name, start, end, t->depth, frame, counters);
+	}
+	else {
+		profilerRecord(t, name, start, end, t->depth, frame);
+	}
+}
+
+// Scoped zone, records itself when it goes out of scope
+struct ProfileScope {
+	ProfilerThread* t;
+	const char* name;
+	uint64_t start;
+	uint64_t counters[noPerfCounters];
+
+	ProfileScope(const char* name) : t(profilerGetThread()), name(name) {
+		if (t) {
+			t->depth++;
+			if (perfCountersEnabled) {
+				profilerReadCounters(t, counters);
+			}
+		}
+		start = profilerNow();
+	}
+
+	~ProfileScope() {
+		if (t) {
+			t->depth--;
+			profilerEndZone(t, name, start, counters);
+		}
+	}
+};
+
+// For zones that don't line up with a C++ scope, every begin needs an end on the same thread
+void profilerBegin(const char* name) {
+	ProfilerThread* t = profilerGetThread();
+	if (t && t->depth < 64) {
+		t->openNames[t->depth] = name;
+		if (perfCountersEnabled) {
+			profilerReadCounters(t, t->openCounters[t->depth]);
+		}
+		t->openStarts[t->depth] = profilerNow();
+		t->depth++;
+	}
+}
+
+void profilerEnd() {
+	ProfilerThread* t = profilerGetThread();
+	if (t && t->depth > 0) {
+		t->depth--;
+		profilerEndZone(t, t->openNames[t->depth], t->openStarts[t->depth], t->openCounters[t->depth]);
+	}
+}
+
+// Call once per frame from the main loop
+void profilerNewFrame() {
+	profilerFrame.fetch_add(1, memory_order_relaxed);
+}
+
+// Write the zones for frames [firstFrame, lastFrame] as trace events into an open traceEvents array
+// first says if nothing has been written to the array yet (so we know when to put commas)
+void profilerWriteZones(ofstream& file, unsigned int firstFrame, unsigned int lastFrame, bool& first) {
+	unsigned int noThreads = min(noProfilerThreads.load(), maxProfilerThreads);
+	for (unsigned int i = 0; i < noThreads; i++) {
+		ProfilerThread* t = profilerThreads[i];
+		if (!t) {
+			continue;
+		}
+
+		file << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t->id
+			<< ",\"args\":{\"name\":\"" << t->name << "\"}}";
+		first = false;
+
+		// Only the last ring's worth of zones is still there, and leave some slack in
+		// case the thread is writing over the oldest ones while we read
+		uint64_t head = t->head.load(memory_order_acquire);
+		uint64_t slack = profilerRingSize / 16;
+		uint64_t oldest = head > profilerRingSize - slack ? head - (profilerRingSize - slack) : 0;
+
+		for (uint64_t z = oldest; z < head; z++) {
+			ProfileZone& zone = t->zones[z & (profilerRingSize - 1)];
+			if (zone.frame < firstFrame || zone.frame > lastFrame) {
+				continue;
+			}
+
+			char line[256];
+			snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u",
+				zone.name, t->id, zone.start / 1000.0, (zone.end - zone.start) / 1000.0, zone.frame);
+			file << line;
+
+			if (zone.counters[PERF_CYCLES] || zone.counters[PERF_INSTRUCTIONS]) {
+				for (unsigned int c = 0; c < noPerfCounters; c++) {
+					file << ",\"" << perfCounterNames[c] << "\":" << zone.counters[c];
+				}
+			}
+			file << "}}";
+		}
+	}
+}
+
+// Write every zone that ended in frames [firstFrame, lastFrame] as Chrome Trace Event JSON
+// Open it in chrome://tracing or ui.perfetto.dev
+void profilerDumpChromeTrace(const char* filename, unsigned int firstFrame, unsigned int lastFrame) {
+	ofstream file(filename);
+	if (!file.is_open()) {
+		cout << "File could not be opened " << filename << endl;
+		return;
+	}
+
+	file << "{\"traceEvents\":[\n";
+	bool first = true;
+	profilerWriteZones(file, firstFrame, lastFrame, first);
+	file << "\n]}\n";
+}
+
+// Per zone name totals of time and counters over everything still in the rings,
+// so we can see which subsystem is bound by what
+void profilerWriteCounterReport(const char* filename) {
+	const unsigned int maxReportZones = 128;
+	struct ZoneTotals {
+		const char* name;
+		unsigned int calls;
+		uint64_t ns;
+		uint64_t counters[noPerfCounters];
+	};
+	ZoneTotals* totals = new ZoneTotals[maxReportZones];
+	unsigned int noTotals = 0;
+
+	unsigned int noThreads = min(noProfilerThreads.load(), maxProfilerThreads);
+	for (unsigned int i = 0; i < noThreads; i++) {
+		ProfilerThread* t = profilerThreads[i];
+		if (!t) {
+			continue;
+		}
+
+		uint64_t head = t->head.load(memory_order_acquire);
+		uint64_t oldest = head > profilerRingSize - profilerRingSize / 16 ? head - (profilerRingSize - profilerRingSize / 16) : 0;
+		for (uint64_t z = oldest; z < head; z++) {
+			ProfileZone& zone = t->zones[z & (profilerRingSize - 1)];
+
+			unsigned int idx = 0;
+			while (idx < noTotals && strcmp(totals[idx].name, zone.name) != 0) {
+				idx++;
+			}
+			if (idx == noTotals) {
+				if (noTotals >= maxReportZones) {
+					continue;
+				}
+				memset(&totals[noTotals], 0, sizeof(ZoneTotals));
+				totals[noTotals++].name = zone.name;
+			}
+
+			totals[idx].calls++;
+			totals[idx].ns += zone.end - zone.start;
+			for (unsigned int c = 0; c < noPerfCounters; c++) {
+				totals[idx].counters[c] += zone.counters[c];
+			}
+		}
+	}
+
+	ofstream file(filename);
+	if (!file.is_open()) {
+		cout << "File could not be opened " << filename << endl;
+		delete[] totals;
+		return;
+	}
+
+	file << "zone                  calls   avg us      IPC  L1D miss/ki  LLC miss/ki  br miss/ki\n";
+	for (unsigned int i = 0; i < noTotals; i++) {
+		ZoneTotals& z = totals[i];
+		double ki = z.counters[PERF_INSTRUCTIONS] / 1000.0;
+		char line[256];
+		snprintf(line, sizeof(line), "%-20s %6u %8.2f %8.2f %12.2f %12.2f %11.2f\n",
+			z.name, z.calls, z.ns / 1000.0 / z.calls,
+			z.counters[PERF_CYCLES] ? (double)z.counters[PERF_INSTRUCTIONS] / z.counters[PERF_CYCLES] : 0.0,
+			ki > 0 ? z.counters[PERF_L1D_MISSES] / ki : 0.0,
+			ki > 0 ? z.counters[PERF_LLC_MISSES] / ki : 0.0,
+			ki > 0 ? z.counters[PERF_BRANCH_MISSES] / ki : 0.0);
+		file << line;
+	}
+
+	delete[] totals;
+}
+
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_ZONE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_BEGIN(name) profilerBegin(name)
+#define PROFILE_END() profilerEnd()
+#define PROFILE_FRAME() profilerNewFrame()
+#define PROFILE_THREAD(name) profilerSetThreadName(name)
+
+#else
+
+#define PROFILE_ZONE(name)
+#define PROFILE_BEGIN(name)
+#define PROFILE_END()
+#define PROFILE_FRAME()
+#define PROFILE_THREAD(name)
+
+#endif
+
 // Shader Funcs
 
 // Read the file
@@ -197,6 +706,22 @@ void setOrthographicProjection(int shaderProgram,
 	glUniformMatrix4fv(glGetUniformLocation(shaderProgram, "projection"), 1, GL_FALSE, &matrix[0][0]);
 }
 
+// Material table
+// Each instance carries an index into this, and the fragment shader multiplies its colour
+// by the material's tint. Restyling things is then just a table write, no extra programs or draws.
+const unsigned int maxMaterials = 64; // Has to match the array size in main.fs
+rgba materialTable[maxMaterials];
+
+void setMaterial(unsigned int idx, rgba tint) {
+	materialTable[idx] = tint;
+}
+
+// Send the material table to the shader, call again whenever materials change
+void uploadMaterials(int shaderProgram) {
+	bindShader(shaderProgram);
+	glUniform4fv(glGetUniformLocation(shaderProgram, "materials"), maxMaterials, &materialTable[0].r);
+}
+
 // Delete the shader
 void deleteShader(int shaderProgram) {
 	glDeleteProgram(shaderProgram);
@@ -212,11 +737,22 @@ void deleteShader(int shaderProgram) {
 struct VAO {
 	GLuint val; // Stores location of the VAO
 	GLuint posVBO;
-	GLuint offsetVBO;
-	GLuint sizeVBO;
+	GLuint instanceVBO; // Per instance data (see InstanceData)
 	GLuint EBO;
 };
 
+// Everything the shader needs per instance, interleaved in one VBO
+// so a whole batch goes up in a single upload
+struct InstanceData {
+	vec2d offset;
+	vec2d size;
+	rgba color;
+	GLuint material; // Index into the material table (0 is plain white)
+};
+
+// Floats per InstanceData, used as the stride when setting attribute pointers
+const GLuint instanceStride = sizeof(InstanceData) / sizeof(float);
+
 // Genereate VAO
 void genVAO(VAO* vao){
 	glGenVertexArrays(1, &vao->val);
@@ -250,6 +786,25 @@ void setAttPointer(GLuint& bo, GLuint idx, GLint size, GLenum type, GLuint strid
 	}
 }
 
+// Same as setAttPointer but for integer attributes (so they don't get converted to floats)
+template<typename T>
+void setAttIPointer(GLuint& bo, GLuint idx, GLint size, GLenum type, GLuint stride, GLuint offset, GLuint divisor = 0) {
+	glBindBuffer(GL_ARRAY_BUFFER, bo);
+	glVertexAttribIPointer(idx, size, type, stride * sizeof(T), (void*)(offset * sizeof(T)));
+	glEnableVertexAttribArray(idx);
+	if (divisor > 0) {
+		glVertexAttribDivisor(idx, divisor);
+	}
+}
+
+// Hook up the instance VBO attributes (offset, size, color, material) on the bound VAO
+void setInstanceAttPointers(GLuint& bo) {
+	setAttPointer<float>(bo, 1, 2, GL_FLOAT, instanceStride, 0, 1);
+	setAttPointer<float>(bo, 2, 2, GL_FLOAT, instanceStride, 2, 1);
+	setAttPointer<float>(bo, 3, 4, GL_FLOAT, instanceStride, 4, 1);
+	setAttIPointer<float>(bo, 4, 1, GL_UNSIGNED_INT, instanceStride, 8, 1);
+}
+
 // Draw VAO
 void draw(VAO vao, GLenum mode, GLuint count, GLenum type, GLint indices, GLuint instanceCount = 1) {
 	glBindVertexArray(vao.val);
@@ -269,8 +824,7 @@ void unbindVAO() {
 // Deallocate VAO/VBO memory
 void cleanup(VAO vao) {
 	glDeleteBuffers(1, &vao.posVBO);
-	glDeleteBuffers(1, &vao.offsetVBO);
-	glDeleteBuffers(1, &vao.sizeVBO);
+	glDeleteBuffers(1, &vao.instanceVBO);
 	glDeleteBuffers(1, &vao.EBO);
 	glDeleteVertexArrays(1, &vao.val);
 }
@@ -325,418 +879,5890 @@ void gen2DCircleArray(float*& vertices, unsigned int*& indices, unsigned int num
 }
 
 //
-// Main Loops
+// GPU Timers
 //
 
-// Window Size changer
-void framebufferSizeCallback(GLFWwindow* window, int width, int height) {
+// CPU zones can't see how long the GPU spends on our draws, so each render pass
+// gets a pair of GL_TIMESTAMP queries around it. Asking for the result straight
+// away would stall until the GPU catches up, so we keep gpuTimerFrames frames of
+// queries in flight and only read a frame's results once we come back around to
+// its slot. By then they're almost always ready, and if not we drop them rather than wait.
+const unsigned int gpuTimerFrames = 3;
+const unsigned int maxGpuPasses = 16;
+
+struct GpuPass {
+	const char* name;
+	GLuint queries[2]; // Begin and end timestamps
+	unsigned int depth;
+};
 
-	glViewport(0, 0, width, height);
-	scrWidth = width;
-	scrHeight = height;
+struct GpuTimerFrame {
+	GpuPass passes[maxGpuPasses];
+	unsigned int noPasses;
+	unsigned int frame; // Profiler frame this was recorded in
+	bool pending; // Still waiting to be read
+};
 
-	//Update Projection Matrix
-	setOrthographicProjection(shaderProgram, 0, width, 0, height, 0.0f, 1.0f);
+struct GpuTimer {
+	GpuTimerFrame frames[gpuTimerFrames];
+	unsigned int frameCount;
+	unsigned int openPasses[maxGpuPasses];
+	unsigned int depth;
+
+	// GPU timestamps + this = profilerNow() time, so GPU passes line up with the CPU zones
+	int64_t gpuToCpuOffset;
+	unsigned int framesSinceCalibration;
+
+	// Latest results we have
+	double frameMs; // Whole frame, first pass begin to last pass end
+	const char* passNames[maxGpuPasses];
+	double passMs[maxGpuPasses];
+	unsigned int noPasses;
+	unsigned int droppedFrames;
+	unsigned int resolvedFrames; // Goes up every time frameMs gets a new value
+
+#if MO_PROFILER
+	ProfilerThread* track;
+#endif
+};
 
-	// Update right padel pos
-	paddleOffsets[1].x = width - 35.0f; 
+GpuTimer gpuTimer;
+
+// Work out the offset between the GPU's clock and ours
+// Clocks drift a bit, so this gets redone every so often
+void gpuTimerCalibrate() {
+	GLint64 gpuNow;
+	glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+	gpuTimer.gpuToCpuOffset = (int64_t)profilerNow() - gpuNow;
+	gpuTimer.framesSinceCalibration = 0;
 }
 
-// Input Processor
-void processInput(GLFWwindow* window, double dt) {
+void genGpuTimer() {
+	for (unsigned int f = 0; f < gpuTimerFrames; f++) {
+		for (unsigned int p = 0; p < maxGpuPasses; p++) {
+			glGenQueries(2, gpuTimer.frames[f].passes[p].queries);
+		}
+		gpuTimer.frames[f].noPasses = 0;
+		gpuTimer.frames[f].pending = false;
+	}
 
-	paddleVelocity[0] = 0.0f;
-	paddleVelocity[1] = 0.0f;
+	gpuTimer.frameCount = 0;
+	gpuTimer.depth = 0;
+	gpuTimer.frameMs = 0.0;
+	gpuTimer.noPasses = 0;
+	gpuTimer.droppedFrames = 0;
+	gpuTimer.resolvedFrames = 0;
+	gpuTimerCalibrate();
 
-	if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
-		glfwSetWindowShouldClose(window, true);
-	}
+#if MO_PROFILER
+	gpuTimer.track = profilerNewTrack("GPU");
+#endif
+}
 
-	// Left Paddle
-	if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
-		if (paddleOffsets[0].y < scrHeight - paddleBoundary) {
-			paddleVelocity[0] = paddleSpeed;
-		}
-		else {
-			paddleOffsets[0].y = scrHeight - paddleBoundary;
-		}
+// Read back a frame's queries if they're done, returns false (without waiting) if they aren't
+bool gpuTimerResolve(GpuTimerFrame& f) {
+	GLint available = 0;
+	glGetQueryObjectiv(f.passes[f.noPasses - 1].queries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available) {
+		return false;
 	}
 
-	if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) {
-		if (paddleOffsets[0].y > paddleBoundary) {
-			paddleVelocity[0] = -paddleSpeed;
-		}
-		else {
-			paddleOffsets[0].y = paddleBoundary;
-		}
-	}
+	GLuint64 frameStart = 0;
+	GLuint64 frameEnd = 0;
+	for (unsigned int p = 0; p < f.noPasses; p++) {
+		GpuPass& pass = f.passes[p];
+		GLuint64 start, end;
+		glGetQueryObjectui64v(pass.queries[0], GL_QUERY_RESULT, &start);
+		glGetQueryObjectui64v(pass.queries[1], GL_QUERY_RESULT, &end);
 
-	// Right Paddle
-	if (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS) {
-		if (paddleOffsets[1].y > paddleBoundary) {
-			paddleVelocity[1] = -paddleSpeed;
+		if (p == 0 || start < frameStart) {
+			frameStart = start;
 		}
-		else {
-			paddleOffsets[1].y = paddleBoundary;
-		}
-	}
+		frameEnd = max(frameEnd, end);
 
-	if (glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS) {
-		if (paddleOffsets[1].y < scrHeight - paddleBoundary) {
-			paddleVelocity[1] = paddleSpeed;
-		}
-		else {
-			paddleOffsets[1].y = scrHeight - paddleBoundary;
+		gpuTimer.passNames[p] = pass.name;
+		gpuTimer.passMs[p] = (end - start) / 1000000.0;
+
+#if MO_PROFILER
+		if (gpuTimer.track) {
+			profilerRecord(gpuTimer.track, pass.name, start + gpuTimer.gpuToCpuOffset, end + gpuTimer.gpuToCpuOffset, pass.depth, f.frame);
 		}
+#endif
 	}
 
-	// pause key
-	if (glfwGetKey(window, GLFW_KEY_P) == GLFW_RELEASE) {
-		pausePressed = false;
+	gpuTimer.noPasses = f.noPasses;
+	gpuTimer.frameMs = (frameEnd - frameStart) / 1000000.0;
+	gpuTimer.resolvedFrames++;
+	return true;
+}
+
+// Call on the GL thread before replaying the frame's commands
+void gpuTimerBeginFrame() {
+	GpuTimerFrame& f = gpuTimer.frames[gpuTimer.frameCount % gpuTimerFrames];
+
+	// This slot was last used gpuTimerFrames frames ago
+	if (f.pending && !gpuTimerResolve(f)) {
+		gpuTimer.droppedFrames++;
 	}
-	else if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS && !pausePressed) {
-		// key just pressed
-		pauseMe = !pauseMe;
-		gameSpeed = pauseMe ? 0.0f : 1.0f;
-		pausePressed = true;
+
+	f.noPasses = 0;
+	f.pending = false;
+#if MO_PROFILER
+	f.frame = profilerFrame.load();
+#else
+	f.frame = gpuTimer.frameCount;
+#endif
+	gpuTimer.depth = 0;
+}
+
+// Call on the GL thread after the frame's commands have been replayed
+void gpuTimerEndFrame() {
+	GpuTimerFrame& f = gpuTimer.frames[gpuTimer.frameCount % gpuTimerFrames];
+	f.pending = f.noPasses > 0;
+	gpuTimer.frameCount++;
+
+	if (++gpuTimer.framesSinceCalibration >= 600) {
+		gpuTimerCalibrate();
 	}
 }
 
+// Passes can nest, every begin needs an end
+void gpuPassBegin(const char* name) {
+	GpuTimerFrame& f = gpuTimer.frames[gpuTimer.frameCount % gpuTimerFrames];
+	if (f.noPasses >= maxGpuPasses || gpuTimer.depth >= maxGpuPasses) {
+		return;
+	}
 
-// Screen clearer
-void clearScreen() {
-	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT);
+	GpuPass& pass = f.passes[f.noPasses];
+	pass.name = name;
+	pass.depth = gpuTimer.depth;
+	glQueryCounter(pass.queries[0], GL_TIMESTAMP);
+	gpuTimer.openPasses[gpuTimer.depth++] = f.noPasses++;
 }
 
-// New Frame
-void newFrame(GLFWwindow* window) {
-	glfwSwapBuffers(window);
-	glfwPollEvents();
+void gpuPassEnd() {
+	if (gpuTimer.depth == 0) {
+		return;
+	}
+
+	GpuTimerFrame& f = gpuTimer.frames[gpuTimer.frameCount % gpuTimerFrames];
+	glQueryCounter(f.passes[gpuTimer.openPasses[--gpuTimer.depth]].queries[1], GL_TIMESTAMP);
 }
 
-// Display the Score
-void displayScore() {
-	cout << leftScore << " - " << rightScore << endl;
+void cleanupGpuTimer() {
+	for (unsigned int f = 0; f < gpuTimerFrames; f++) {
+		for (unsigned int p = 0; p < maxGpuPasses; p++) {
+			glDeleteQueries(2, gpuTimer.frames[f].passes[p].queries);
+		}
+	}
 }
 
 //
-// Cleanupers
+// Frame Stats
 //
-void cleanup() {
-	glfwTerminate();
-}
 
-int main() {
-	cout << "Hello World!" << endl;
+// Counters for what the frame actually did, filled in as the commands get replayed
+struct FrameStats {
+	unsigned int drawCalls;
+	unsigned int glCalls;
+	unsigned int instances;
+	unsigned int uploadBytes;
+	unsigned int allocations;
+};
 
-	// Timing
-	double dt = 0.0;
-	double lastFrame = 0.0;
+FrameStats frameStats;
 
-	// Init (I am using OpenGL version 3.3
-	initGLFW(3, 3);
+// Every heap allocation goes through here so we can see how many happen per frame.
+// The count is per thread so work on other threads doesn't get charged to the game
+// thread, the frame stats only ever read the game thread's
+thread_local unsigned int allocationCount = 0;
 
-	// Create the window
-	GLFWwindow* window = nullptr;
-	createWindow(window, title, scrWidth, scrHeight, framebufferSizeCallback);
-	if (!window) {
-		cout << "Window could not be created" << endl;
-		cleanup();
-		return -1;
+void* operator new(size_t size) {
+	allocationCount++;
+	void* p = malloc(size ? size : 1);
+	if (!p) {
+		throw bad_alloc();
 	}
+	return p;
+}
 
-	// Load Glad
-	if (!loadGlad()) {
-		cout << "Glad could ot be loaded" << endl;
-		cleanup();
-		return -1;
-	}
+void operator delete(void* p) noexcept {
+	free(p);
+}
 
-	glViewport(0, 0, scrWidth, scrHeight);
+void operator delete(void* p, size_t /*size*/) noexcept {
+	free(p);
+}
+
+// Start counting a new frame, only call these from the game thread
+void resetFrameStats() {
+	frameStats = { 0, 0, 0, 0, 0 };
+	frameStats.allocations = allocationCount;
+}
+
+// Finish counting, returns what happened since resetFrameStats
+FrameStats endFrameStats() {
+	FrameStats stats = frameStats;
+	stats.allocations = allocationCount - frameStats.allocations;
+	return stats;
+}
+
+//
+// Frame Time Histograms
+//
+
+// Averages hide stutter, so every frame's CPU time, GPU time and present interval go
+// into an HDR histogram. Buckets are log-linear: each power of two range gets the same
+// number of linear sub-buckets, so every value is kept to within 1% (2 significant
+// digits) from 1 us all the way up to minutes, in a fixed 21KB per histogram.
+//
+// The bucket layout never changes, so histograms from different sessions/machines
+// merge by just adding up the counts at each bucket.
+const unsigned int hdrSubBucketCount = 256; // 2 * 10^2 rounded up to a power of two
+const unsigned int hdrSubBucketHalfCount = hdrSubBucketCount / 2;
+const unsigned int hdrSubBucketHalfCountMagnitude = 7; // log2(hdrSubBucketHalfCount)
+const unsigned int hdrBucketCount = 20; // 256 << 19 us is a bit over 2 minutes
+const unsigned int hdrCountsLength = (hdrBucketCount + 1) * hdrSubBucketHalfCount;
+const uint64_t hdrHighestValue = ((uint64_t)hdrSubBucketCount << (hdrBucketCount - 1)) - 1;
+
+struct HdrHistogram {
+	const char* name;
+	uint64_t counts[hdrCountsLength];
+	uint64_t totalCount;
+	uint64_t minValue;
+	uint64_t maxValue;
+};
+
+// Values are in microseconds, named by genHistogram
+HdrHistogram cpuHistogram;
+HdrHistogram gpuHistogram;
+HdrHistogram presentHistogram;
+
+// Print the summaries (F9)
+bool histogramPrintRequested = false;
+
+void resetHistogram(HdrHistogram& h) {
+	memset(h.counts, 0, sizeof(h.counts));
+	h.totalCount = 0;
+	h.minValue = UINT64_MAX;
+	h.maxValue = 0;
+}
+
+// name is what it's called in the printouts and the export
+void genHistogram(HdrHistogram& h, const char* name) {
+	h.name = name;
+	resetHistogram(h);
+}
+
+// Position of the highest set bit + 1
+unsigned int bitLength(uint64_t value) {
+	unsigned int bits = 0;
+	while (value) {
+		bits++;
+		value >>= 1;
+	}
+	return bits;
+}
+
+unsigned int hdrCountsIndex(uint64_t value) {
+	// Which power of two range, then where in it
+	unsigned int bucket = bitLength(value | (hdrSubBucketCount - 1)) - (hdrSubBucketHalfCountMagnitude + 1);
+	unsigned int subBucket = (unsigned int)(value >> bucket);
+	return ((bucket + 1) << hdrSubBucketHalfCountMagnitude) + (subBucket - hdrSubBucketHalfCount);
+}
+
+// Smallest value that lands in counts[idx]
+uint64_t hdrValueFromIndex(unsigned int idx) {
+	int bucket = (int)(idx >> hdrSubBucketHalfCountMagnitude) - 1;
+	unsigned int subBucket = (idx & (hdrSubBucketHalfCount - 1)) + hdrSubBucketHalfCount;
+	if (bucket < 0) {
+		subBucket -= hdrSubBucketHalfCount;
+		bucket = 0;
+	}
+	return (uint64_t)subBucket << bucket;
+}
+
+// Largest value that lands in the same bucket as value
+uint64_t hdrHighestEquivalentValue(uint64_t value) {
+	unsigned int bucket = bitLength(value | (hdrSubBucketCount - 1)) - (hdrSubBucketHalfCountMagnitude + 1);
+	return value | ((1ull << bucket) - 1);
+}
+
+void histogramRecord(HdrHistogram& h, uint64_t value) {
+	value = min(value, hdrHighestValue);
+	h.counts[hdrCountsIndex(value)]++;
+	h.totalCount++;
+	h.minValue = min(h.minValue, value);
+	h.maxValue = max(h.maxValue, value);
+}
+
+// Value at percentile p (0 to 100)
+uint64_t histogramPercentile(HdrHistogram& h, double p) {
+	if (h.totalCount == 0) {
+		return 0;
+	}
+
+	uint64_t target = (uint64_t)ceil(p / 100.0 * h.totalCount);
+	target = max(target, (uint64_t)1);
+
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < hdrCountsLength; i++) {
+		seen += h.counts[i];
+		if (seen >= target) {
+			return min(hdrHighestEquivalentValue(hdrValueFromIndex(i)), h.maxValue);
+		}
+	}
+	return h.maxValue;
+}
+
+void printHistogram(HdrHistogram& h) {
+	char line[192];
+	if (h.totalCount == 0) {
+		snprintf(line, sizeof(line), "%-11s no samples", h.name);
+	}
+	else {
+		snprintf(line, sizeof(line), "%-11s n %8llu  min %7.3f  p50 %7.3f  p99 %7.3f  p99.9 %7.3f  max %7.3f ms",
+			h.name, (unsigned long long)h.totalCount, h.minValue / 1000.0,
+			histogramPercentile(h, 50.0) / 1000.0, histogramPercentile(h, 99.0) / 1000.0,
+			histogramPercentile(h, 99.9) / 1000.0, h.maxValue / 1000.0);
+	}
+	cout << line << endl;
+}
+
+void printFrameHistograms() {
+	printHistogram(cpuHistogram);
+	printHistogram(gpuHistogram);
+	printHistogram(presentHistogram);
+}
+
+// Sparse [lowest value in bucket, count] pairs plus the summary
+void writeHistogram(ofstream& file, HdrHistogram& h) {
+	file << "\"" << h.name << "\":{\"total\":" << h.totalCount
+		<< ",\"min\":" << (h.totalCount ? h.minValue : 0) << ",\"max\":" << h.maxValue
+		<< ",\"p50\":" << histogramPercentile(h, 50.0)
+		<< ",\"p99\":" << histogramPercentile(h, 99.0)
+		<< ",\"p99_9\":" << histogramPercentile(h, 99.9)
+		<< ",\"counts\":[";
+
+	bool first = true;
+	for (unsigned int i = 0; i < hdrCountsLength; i++) {
+		if (h.counts[i] == 0) {
+			continue;
+		}
+		file << (first ? "" : ",") << "[" << hdrValueFromIndex(i) << "," << h.counts[i] << "]";
+		first = false;
+	}
+	file << "]}";
+}
+
+// extra is any other histograms to put in the same file (like the latency ones)
+void exportFrameHistograms(const char* filename, time_t sessionStart, HdrHistogram** extra = nullptr, unsigned int noExtra = 0) {
+	ofstream file(filename);
+	if (!file.is_open()) {
+		cout << "File could not be opened " << filename << endl;
+		return;
+	}
+
+	file << "{\"session_start\":" << (long long)sessionStart
+		<< ",\"session_end\":" << (long long)time(nullptr)
+		<< ",\"unit\":\"us\",\"significant_digits\":2,\n";
+	writeHistogram(file, cpuHistogram);
+	file << ",\n";
+	writeHistogram(file, gpuHistogram);
+	file << ",\n";
+	writeHistogram(file, presentHistogram);
+	for (unsigned int i = 0; i < noExtra; i++) {
+		file << ",\n";
+		writeHistogram(file, *extra[i]);
+	}
+	file << "\n}\n";
+}
+
+//
+// Render Command Buffers
+//
+
+// Instead of calling GL straight from the game code, we record what we want done
+// into a command buffer. Recording never touches GL, so any thread can fill its own
+// buffer, and then the GL thread replays them all in order (see Parallel Recording).
+// Buffers are allocated once up front so recording a frame never allocates.
+enum RenderCommandType : unsigned char {
+	CMD_CLEAR,
+	CMD_BIND_SHADER,
+	CMD_BIND_TEXTURE,
+	CMD_UPLOAD,
+	CMD_DRAW,
+	CMD_GPU_PASS_BEGIN,
+	CMD_GPU_PASS_END,
+	CMD_BIND_FRAMEBUFFER,
+	CMD_BLIT
+};
+
+struct ClearCommand {
+	float r, g, b, a;
+};
+
+struct BindShaderCommand {
+	GLuint program;
+};
+
+struct BindTextureCommand {
+	GLuint texture;
+};
+
+struct UploadCommand {
+	GLuint bo;
+	GLintptr offset;
+	GLuint size; // In bytes
+	GLuint dataOffset; // Where the bytes live in the buffer's upload data
+};
+
+struct DrawCommand {
+	GLuint vao;
+	GLenum mode;
+	GLuint count;
+	GLenum type;
+	GLintptr indices;
+	GLuint instanceCount;
+};
+
+struct GpuPassCommand {
+	const char* name;
+};
+
+// Also sets the viewport, since that's always the next thing you want
+struct BindFramebufferCommand {
+	GLuint fbo; // 0 for the window
+	GLsizei width, height;
+};
+
+struct BlitCommand {
+	GLuint src;
+	GLsizei srcWidth, srcHeight;
+	GLuint dst;
+	GLsizei dstWidth, dstHeight;
+};
+
+struct RenderCommand {
+	RenderCommandType type;
+	union {
+		ClearCommand clear;
+		BindShaderCommand bindShader;
+		BindTextureCommand bindTexture;
+		UploadCommand upload;
+		DrawCommand draw;
+		GpuPassCommand gpuPass;
+		BindFramebufferCommand bindFramebuffer;
+		BlitCommand blit;
+	};
+};
+
+struct CommandBuffer {
+	RenderCommand* commands;
+	unsigned int noCommands;
+	unsigned int maxCommands;
+
+	// Upload payloads get copied in here so the caller's data can change right after recording
+	unsigned char* uploadData;
+	unsigned int uploadBytes;
+	unsigned int maxUploadBytes;
+
+	bool overflowed; // Set if something didn't fit, so we can tell it got dropped
+};
+
+// Allocate the storage for a command buffer
+void genCommandBuffer(CommandBuffer& cb, unsigned int maxCommands, unsigned int maxUploadBytes) {
+	cb.commands = new RenderCommand[maxCommands];
+	cb.noCommands = 0;
+	cb.maxCommands = maxCommands;
+	cb.uploadData = new unsigned char[maxUploadBytes];
+	cb.uploadBytes = 0;
+	cb.maxUploadBytes = maxUploadBytes;
+	cb.overflowed = false;
+}
+
+// Empty the buffer so we can record the next frame into it
+void resetCommands(CommandBuffer& cb) {
+	cb.noCommands = 0;
+	cb.uploadBytes = 0;
+	cb.overflowed = false;
+}
+
+// Grab the next free command slot (nullptr if the buffer is full)
+RenderCommand* pushCommand(CommandBuffer& cb, RenderCommandType type) {
+	if (cb.noCommands >= cb.maxCommands) {
+		cb.overflowed = true;
+		return nullptr;
+	}
+
+	RenderCommand* cmd = &cb.commands[cb.noCommands++];
+	cmd->type = type;
+	return cmd;
+}
+
+void cmdClear(CommandBuffer& cb, float r, float g, float b, float a) {
+	RenderCommand* cmd = pushCommand(cb, CMD_CLEAR);
+	if (cmd) {
+		cmd->clear = { r, g, b, a };
+	}
+}
+
+void cmdBindShader(CommandBuffer& cb, GLuint program) {
+	RenderCommand* cmd = pushCommand(cb, CMD_BIND_SHADER);
+	if (cmd) {
+		cmd->bindShader = { program };
+	}
+}
+
+// Binds to texture unit 0, which is the only one we use
+void cmdBindTexture(CommandBuffer& cb, GLuint texture) {
+	RenderCommand* cmd = pushCommand(cb, CMD_BIND_TEXTURE);
+	if (cmd) {
+		cmd->bindTexture = { texture };
+	}
+}
+
+// Same arguments as updateData, but the data is copied and uploaded at replay time
+template<typename T>
+void cmdUpload(CommandBuffer& cb, GLuint bo, GLintptr offset, GLuint noElements, T* data) {
+	GLuint size = noElements * sizeof(T);
+	if (cb.uploadBytes + size > cb.maxUploadBytes) {
+		cb.overflowed = true;
+		return;
+	}
+
+	RenderCommand* cmd = pushCommand(cb, CMD_UPLOAD);
+	if (!cmd) {
+		return;
+	}
+
+	memcpy(cb.uploadData + cb.uploadBytes, data, size);
+	cmd->upload = { bo, offset, size, cb.uploadBytes };
+	cb.uploadBytes += size;
+}
+
+// Same arguments as draw
+void cmdDraw(CommandBuffer& cb, VAO vao, GLenum mode, GLuint count, GLenum type, GLint indices, GLuint instanceCount = 1) {
+	RenderCommand* cmd = pushCommand(cb, CMD_DRAW);
+	if (cmd) {
+		cmd->draw = { vao.val, mode, count, type, indices, instanceCount };
+	}
+}
+
+// Time everything recorded between these two on the GPU (see gpuPassBegin)
+void cmdGpuPassBegin(CommandBuffer& cb, const char* name) {
+	RenderCommand* cmd = pushCommand(cb, CMD_GPU_PASS_BEGIN);
+	if (cmd) {
+		cmd->gpuPass = { name };
+	}
+}
+
+void cmdGpuPassEnd(CommandBuffer& cb) {
+	pushCommand(cb, CMD_GPU_PASS_END);
+}
+
+// Draw into fbo from here on, with a width x height viewport
+void cmdBindFramebuffer(CommandBuffer& cb, GLuint fbo, GLsizei width, GLsizei height) {
+	RenderCommand* cmd = pushCommand(cb, CMD_BIND_FRAMEBUFFER);
+	if (cmd) {
+		cmd->bindFramebuffer = { fbo, width, height };
+	}
+}
+
+// Stretch the bottom left srcWidth x srcHeight of src over dst, and leave dst bound for drawing
+void cmdBlit(CommandBuffer& cb, GLuint src, GLsizei srcWidth, GLsizei srcHeight, GLuint dst, GLsizei dstWidth, GLsizei dstHeight) {
+	RenderCommand* cmd = pushCommand(cb, CMD_BLIT);
+	if (cmd) {
+		cmd->blit = { src, srcWidth, srcHeight, dst, dstWidth, dstHeight };
+	}
+}
+
+// Replay a recorded buffer, this has to run on the thread that owns the GL context
+void executeCommands(CommandBuffer& cb) {
+	for (unsigned int i = 0; i < cb.noCommands; i++) {
+		RenderCommand& cmd = cb.commands[i];
+
+		switch (cmd.type) {
+		case CMD_CLEAR:
+			glClearColor(cmd.clear.r, cmd.clear.g, cmd.clear.b, cmd.clear.a);
+			glClear(GL_COLOR_BUFFER_BIT);
+			frameStats.glCalls += 2;
+			break;
+		case CMD_BIND_SHADER:
+			glUseProgram(cmd.bindShader.program);
+			frameStats.glCalls++;
+			break;
+		case CMD_BIND_TEXTURE:
+			glBindTexture(GL_TEXTURE_2D, cmd.bindTexture.texture);
+			frameStats.glCalls++;
+			break;
+		case CMD_UPLOAD:
+			glBindBuffer(GL_ARRAY_BUFFER, cmd.upload.bo);
+			glBufferSubData(GL_ARRAY_BUFFER, cmd.upload.offset, cmd.upload.size, cb.uploadData + cmd.upload.dataOffset);
+			frameStats.glCalls += 2;
+			frameStats.uploadBytes += cmd.upload.size;
+			break;
+		case CMD_DRAW:
+			glBindVertexArray(cmd.draw.vao);
+			glDrawElementsInstanced(cmd.draw.mode, cmd.draw.count, cmd.draw.type, (void*)cmd.draw.indices, cmd.draw.instanceCount);
+			frameStats.glCalls += 2;
+			frameStats.drawCalls++;
+			frameStats.instances += cmd.draw.instanceCount;
+			break;
+		case CMD_GPU_PASS_BEGIN:
+			gpuPassBegin(cmd.gpuPass.name);
+			frameStats.glCalls++;
+			break;
+		case CMD_GPU_PASS_END:
+			gpuPassEnd();
+			frameStats.glCalls++;
+			break;
+		case CMD_BIND_FRAMEBUFFER:
+			glBindFramebuffer(GL_FRAMEBUFFER, cmd.bindFramebuffer.fbo);
+			glViewport(0, 0, cmd.bindFramebuffer.width, cmd.bindFramebuffer.height);
+			frameStats.glCalls += 2;
+			break;
+		case CMD_BLIT:
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, cmd.blit.src);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, cmd.blit.dst);
+			glBlitFramebuffer(0, 0, cmd.blit.srcWidth, cmd.blit.srcHeight, 0, 0, cmd.blit.dstWidth, cmd.blit.dstHeight, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+			glBindFramebuffer(GL_FRAMEBUFFER, cmd.blit.dst);
+			glViewport(0, 0, cmd.blit.dstWidth, cmd.blit.dstHeight);
+			frameStats.glCalls += 5;
+			break;
+		}
+	}
+}
+
+// Replay several buffers (e.g. one per worker thread) in the order given
+void executeCommandBuffers(CommandBuffer* cbs, unsigned int noBuffers) {
+	for (unsigned int i = 0; i < noBuffers; i++) {
+		executeCommands(cbs[i]);
+	}
+}
+
+// Write the command streams out as text (in replay order) so we can look at a frame offline
+void dumpCommands(CommandBuffer* cbs, unsigned int noBuffers, const char* filename) {
+	ofstream file(filename);
+	if (!file.is_open()) {
+		cout << "File could not be opened " << filename << endl;
+		return;
+	}
+
+	for (unsigned int b = 0; b < noBuffers; b++) {
+		CommandBuffer& cb = cbs[b];
+		file << "buffer " << b << " commands " << cb.noCommands << " uploadBytes " << cb.uploadBytes
+			<< (cb.overflowed ? " OVERFLOWED" : "") << "\n";
+
+		for (unsigned int i = 0; i < cb.noCommands; i++) {
+			RenderCommand& cmd = cb.commands[i];
+
+			switch (cmd.type) {
+			case CMD_CLEAR:
+				file << i << " clear " << cmd.clear.r << " " << cmd.clear.g << " " << cmd.clear.b << " " << cmd.clear.a << "\n";
+				break;
+			case CMD_BIND_SHADER:
+				file << i << " bindShader " << cmd.bindShader.program << "\n";
+				break;
+			case CMD_BIND_TEXTURE:
+				file << i << " bindTexture " << cmd.bindTexture.texture << "\n";
+				break;
+			case CMD_UPLOAD:
+				file << i << " upload bo " << cmd.upload.bo << " offset " << cmd.upload.offset << " bytes " << cmd.upload.size << "\n";
+				break;
+			case CMD_DRAW:
+				file << i << " draw vao " << cmd.draw.vao << " mode " << cmd.draw.mode << " count " << cmd.draw.count
+					<< " instances " << cmd.draw.instanceCount << "\n";
+				break;
+			case CMD_GPU_PASS_BEGIN:
+				file << i << " gpuPassBegin " << cmd.gpuPass.name << "\n";
+				break;
+			case CMD_GPU_PASS_END:
+				file << i << " gpuPassEnd\n";
+				break;
+			case CMD_BIND_FRAMEBUFFER:
+				file << i << " bindFramebuffer " << cmd.bindFramebuffer.fbo << " " << cmd.bindFramebuffer.width << "x" << cmd.bindFramebuffer.height << "\n";
+				break;
+			case CMD_BLIT:
+				file << i << " blit " << cmd.blit.src << " " << cmd.blit.srcWidth << "x" << cmd.blit.srcHeight
+					<< " to " << cmd.blit.dst << " " << cmd.blit.dstWidth << "x" << cmd.blit.dstHeight << "\n";
+				break;
+			}
+		}
+	}
+}
+
+// Free the command buffer storage
+void cleanup(CommandBuffer& cb) {
+	delete[] cb.commands;
+	delete[] cb.uploadData;
+	cb.commands = nullptr;
+	cb.uploadData = nullptr;
+}
+
+//
+// Render Queue (Sort Key Batching)
+//
+
+// Rather than drawing things in whatever order the loop happens to get to them,
+// everything gets submitted to a render queue with a 64 bit sort key. Once a frame
+// we radix sort the keys and merge neighbours that use the same program, mesh
+// and material into one instanced draw, so state only changes when it has to.
+//
+// Key layout (most significant first):
+// layer 8 | program 8 | mesh 12 | material 12 | depth 24
+// The material here is for things that need a state change (like a different texture),
+// material table entries ride along in the instance data and don't split batches.
+const unsigned int maxPrograms = 256;
+const unsigned int maxMeshes = 4096;
+const unsigned int maxInstancesPerMesh = 1024;
+
+// A mesh is just a VAO we know how to draw plus how big its instance buffer is
+struct Mesh {
+	VAO vao;
+	GLenum mode;
+	GLuint indexCount;
+	GLuint maxInstances;
+};
+
+// Registered programs and meshes, the ids in the sort key index into these
+// The game has its own, benchmarks make theirs so they don't use up the game's ids
+struct RenderTables {
+	GLuint programs[maxPrograms];
+	unsigned int noPrograms;
+	Mesh meshes[maxMeshes];
+	unsigned int noMeshes;
+};
+
+RenderTables renderTables;
+
+void genRenderTables(RenderTables& tables) {
+	tables.noPrograms = 0;
+	tables.noMeshes = 0;
+}
+
+// The ids have to fit in their bits of the sort key, so running out is a bug, not
+// something we can carry on from (every id past the end would draw with the wrong thing)
+unsigned int registerProgram(RenderTables& tables, GLuint program) {
+	if (tables.noPrograms >= maxPrograms) {
+		cout << "Too many programs registered, the sort key only has room for " << maxPrograms << endl;
+		abort();
+	}
+
+	tables.programs[tables.noPrograms] = program;
+	return tables.noPrograms++;
+}
+
+unsigned int registerMesh(RenderTables& tables, VAO vao, GLenum mode, GLuint indexCount, GLuint maxInstances) {
+	if (tables.noMeshes >= maxMeshes) {
+		cout << "Too many meshes registered, the sort key only has room for " << maxMeshes << endl;
+		abort();
+	}
+
+	tables.meshes[tables.noMeshes] = { vao, mode, indexCount, maxInstances };
+	return tables.noMeshes++;
+}
+
+uint64_t makeSortKey(unsigned int layer, unsigned int program, unsigned int mesh, unsigned int material, unsigned int depth) {
+	return ((uint64_t)(layer & 0xff) << 56)
+		| ((uint64_t)(program & 0xff) << 48)
+		| ((uint64_t)(mesh & 0xfff) << 36)
+		| ((uint64_t)(material & 0xfff) << 24)
+		| (uint64_t)(depth & 0xffffff);
+}
+
+unsigned int sortKeyProgram(uint64_t key) {
+	return (unsigned int)(key >> 48) & 0xff;
+}
+
+unsigned int sortKeyMesh(uint64_t key) {
+	return (unsigned int)(key >> 36) & 0xfff;
+}
+
+// Program, mesh and material, the bits that have to match for two submissions to share a draw
+uint64_t sortKeyBatch(uint64_t key) {
+	return (key >> 24) & 0xffffffffull;
+}
+
+// We sort (key, index) pairs instead of the submissions themselves so each pass only moves 16 bytes
+struct SortItem {
+	uint64_t key;
+	unsigned int idx;
+};
+
+struct RenderQueue {
+	SortItem* items;
+	SortItem* scratch; // Ping pong buffer for the radix sort
+	InstanceData* instances; // Instance data of each submission, indexed by SortItem::idx
+	InstanceData* batch; // Instances of the batch being built, in sorted order
+	unsigned int noSubmissions;
+	unsigned int maxSubmissions;
+	RenderTables* tables; // What the keys' program and mesh ids mean
+};
+
+void genRenderQueue(RenderQueue& queue, RenderTables& tables, unsigned int maxSubmissions) {
+	queue.items = new SortItem[maxSubmissions];
+	queue.scratch = new SortItem[maxSubmissions];
+	queue.instances = new InstanceData[maxSubmissions];
+	queue.batch = new InstanceData[maxSubmissions];
+	queue.noSubmissions = 0;
+	queue.maxSubmissions = maxSubmissions;
+	queue.tables = &tables;
+}
+
+// Add one instance to this frame's queue
+void submitDraw(RenderQueue& queue, uint64_t key, const InstanceData& instance) {
+	if (queue.noSubmissions >= queue.maxSubmissions) {
+		return;
+	}
+
+	queue.items[queue.noSubmissions] = { key, queue.noSubmissions };
+	queue.instances[queue.noSubmissions] = instance;
+	queue.noSubmissions++;
+}
+
+// LSD radix sort on the keys, one byte per pass
+// Passes where every key has the same byte are skipped, which is most of them since
+// a frame only uses a handful of layers/programs/meshes
+void radixSort(SortItem*& items, SortItem*& scratch, unsigned int count) {
+	unsigned int histogram[256];
+
+	for (unsigned int shift = 0; shift < 64; shift += 8) {
+		memset(histogram, 0, sizeof(histogram));
+		for (unsigned int i = 0; i < count; i++) {
+			histogram[(items[i].key >> shift) & 0xff]++;
+		}
+
+		if (histogram[(items[0].key >> shift) & 0xff] == count) {
+			continue;
+		}
+
+		// Turn the counts into starting positions
+		unsigned int total = 0;
+		for (unsigned int b = 0; b < 256; b++) {
+			unsigned int c = histogram[b];
+			histogram[b] = total;
+			total += c;
+		}
+
+		for (unsigned int i = 0; i < count; i++) {
+			scratch[histogram[(items[i].key >> shift) & 0xff]++] = items[i];
+		}
+
+		SortItem* tmp = items;
+		items = scratch;
+		scratch = tmp;
+	}
+}
+
+// Sort the queue and record the batched draws into the command buffer
+// Only binds a program when it changes, and each run of compatible submissions
+// becomes one upload and one instanced draw
+void flushRenderQueue(RenderQueue& queue, CommandBuffer& cb) {
+	if (queue.noSubmissions == 0) {
+		return;
+	}
+
+	radixSort(queue.items, queue.scratch, queue.noSubmissions);
+
+	unsigned int boundProgram = maxPrograms; // Nothing bound yet
+	unsigned int i = 0;
+	while (i < queue.noSubmissions) {
+		uint64_t key = queue.items[i].key;
+		uint64_t batchKey = sortKeyBatch(key);
+		unsigned int program = sortKeyProgram(key);
+		Mesh& mesh = queue.tables->meshes[sortKeyMesh(key)];
+
+		// Gather the run
+		unsigned int noInstances = 0;
+		while (i < queue.noSubmissions && sortKeyBatch(queue.items[i].key) == batchKey && noInstances < mesh.maxInstances) {
+			queue.batch[noInstances++] = queue.instances[queue.items[i].idx];
+			i++;
+		}
+
+		if (program != boundProgram) {
+			cmdBindShader(cb, queue.tables->programs[program]);
+			boundProgram = program;
+		}
+
+		// GL 3.3 has no base instance, so every batch starts at the front of the mesh's instance buffer.
+		// A mesh normally only shows up in one batch per frame once sorted anyway.
+		cmdUpload<InstanceData>(cb, mesh.vao.instanceVBO, 0, noInstances, queue.batch);
+		cmdDraw(cb, mesh.vao, mesh.mode, mesh.indexCount, GL_UNSIGNED_INT, 0, noInstances);
+	}
+
+	queue.noSubmissions = 0;
+}
+
+void cleanup(RenderQueue& queue) {
+	delete[] queue.items;
+	delete[] queue.scratch;
+	delete[] queue.instances;
+	delete[] queue.batch;
+}
+
+//
+// Game Meshes
+//
+
+// Paddle quad, a unit square that gets scaled by the instance size
+// Everything is drawn in the form of triangles
+// So we setup a vertex array to hold the "endpoints" of a triangle
+// Setup vertex data
+const float paddleVertices[] = {
+//		x		y
+		0.5f, 0.5f, // Index 0
+		-0.5f, 0.5f, // Index 1
+		-0.5f, -0.5f, // Index 2
+		0.5f, -0.5f // Index 3
+};
+
+// Then this index array holds the order of vertices which tells the order of drawing
+// Index data
+const unsigned int paddleIndices[] = {
+	0, 1, 2, 
+	2, 3, 0
+};
+
+VAO genPaddleVAO() {
+	VAO paddleVAO;
+	genVAO(&paddleVAO);
+
+	// pos VBO
+	genBufferObject<const float>(paddleVAO.posVBO, GL_ARRAY_BUFFER, 2 * 4, paddleVertices, GL_STATIC_DRAW);
+	setAttPointer<float>(paddleVAO.posVBO, 0, 2, GL_FLOAT, 2, 0);
+
+	// instance VBO (offset, size, color and material per paddle), filled by the render queue every frame
+	genBufferObject<InstanceData>(paddleVAO.instanceVBO, GL_ARRAY_BUFFER, maxInstancesPerMesh, nullptr, GL_DYNAMIC_DRAW);
+	setInstanceAttPointers(paddleVAO.instanceVBO);
+
+	// EBO
+	genBufferObject<const GLuint>(paddleVAO.EBO, GL_ELEMENT_ARRAY_BUFFER, 3 * 2, paddleIndices, GL_STATIC_DRAW);
+
+	// unbind VBO and VAO
+	unbindBuffer(GL_ARRAY_BUFFER);
+	unbindVAO();
+
+	return paddleVAO;
+}
+
+// Pong ball, a unit circle made of numOfTtriangles triangles
+VAO genPongVAO(unsigned int numOfTtriangles) {
+	float* pongVertices;
+	unsigned int* pongIndices;
+	gen2DCircleArray(pongVertices, pongIndices, numOfTtriangles, 0.5f);
+
+	VAO pongVAO;
+	genVAO(&pongVAO);
+
+	// Pos VBO
+	// The vertices are 2 per incides with 4 total indices, and we use static draw since the data wont likely change
+	// to help ease the GPU's troubles :)
+	genBufferObject<float>(pongVAO.posVBO, GL_ARRAY_BUFFER, 2 * (numOfTtriangles + 1), pongVertices, GL_STATIC_DRAW);
+	setAttPointer<float>(pongVAO.posVBO, 0, 2, GL_FLOAT, 2, 0);
+
+	// Instance VBO
+	// Offset, size, color and material interleaved, and we use dyanmic draw to tell the GPU that this will likely change every frame
+	genBufferObject<InstanceData>(pongVAO.instanceVBO, GL_ARRAY_BUFFER, maxInstancesPerMesh, nullptr, GL_DYNAMIC_DRAW);
+	setInstanceAttPointers(pongVAO.instanceVBO);
+
+	// EBO
+	genBufferObject<unsigned int>(pongVAO.EBO, GL_ELEMENT_ARRAY_BUFFER, 3 * (numOfTtriangles), pongIndices, GL_STATIC_DRAW);
+
+	// Unbind VBO and VAO
+	unbindBuffer(GL_ARRAY_BUFFER);
+	unbindVAO();
+
+	// The GPU has its own copy now
+	delete[] pongVertices;
+	delete[] pongIndices;
+
+	return pongVAO;
+}
+
+//
+// Sprites & Texture Atlas
+//
+
+// RGBA8 image, rows go bottom to top like GL textures do
+struct Image {
+	unsigned int width;
+	unsigned int height;
+	unsigned char* pixels;
+};
+
+// Load an uncompressed 24 or 32 bit TGA into an RGBA image
+bool loadImage(const char* filename, Image& image) {
+	ifstream file(filename, ios::binary);
+	if (!file.is_open()) {
+		cout << "File could not be opened " << filename << endl;
+		return false;
+	}
+
+	unsigned char header[18];
+	file.read((char*)header, 18);
+
+	// [2] is the image type (2 = uncompressed true colour), [16] is bits per pixel
+	if (!file || header[1] != 0 || header[2] != 2 || (header[16] != 24 && header[16] != 32)) {
+		cout << "Only uncompressed 24/32 bit TGAs are supported " << filename << endl;
+		return false;
+	}
+
+	file.seekg(header[0], ios::cur); // Skip the image id
+
+	image.width = header[12] | (header[13] << 8);
+	image.height = header[14] | (header[15] << 8);
+	unsigned int bytesPerPixel = header[16] / 8;
+	bool topDown = (header[17] & 0x20) != 0;
+
+	unsigned int noBytes = image.width * image.height * bytesPerPixel;
+	unsigned char* raw = new unsigned char[noBytes];
+	file.read((char*)raw, noBytes);
+	if (!file) {
+		cout << "TGA is truncated " << filename << endl;
+		delete[] raw;
+		return false;
+	}
+
+	// TGA stores BGR(A), flip to RGBA and make sure row 0 is the bottom
+	image.pixels = new unsigned char[image.width * image.height * 4];
+	for (unsigned int y = 0; y < image.height; y++) {
+		unsigned int srcRow = topDown ? image.height - 1 - y : y;
+		for (unsigned int x = 0; x < image.width; x++) {
+			unsigned char* src = raw + (srcRow * image.width + x) * bytesPerPixel;
+			unsigned char* dst = image.pixels + (y * image.width + x) * 4;
+			dst[0] = src[2];
+			dst[1] = src[1];
+			dst[2] = src[0];
+			dst[3] = bytesPerPixel == 4 ? src[3] : 255;
+		}
+	}
+
+	delete[] raw;
+	return true;
+}
+
+// Save an RGBA image as an uncompressed 32 bit TGA (bottom row first, same as our images)
+bool saveImage(const char* filename, const Image& image) {
+	ofstream file(filename, ios::binary);
+	if (!file.is_open()) {
+		cout << "File could not be opened " << filename << endl;
+		return false;
+	}
+
+	unsigned char header[18] = {};
+	header[2] = 2;
+	header[12] = image.width & 0xff;
+	header[13] = (image.width >> 8) & 0xff;
+	header[14] = image.height & 0xff;
+	header[15] = (image.height >> 8) & 0xff;
+	header[16] = 32;
+	header[17] = 8; // 8 bits of alpha, bottom up
+	file.write((char*)header, 18);
+
+	// Back to BGRA a row at a time
+	unsigned char* row = new unsigned char[image.width * 4];
+	for (unsigned int y = 0; y < image.height; y++) {
+		const unsigned char* src = image.pixels + y * image.width * 4;
+		for (unsigned int x = 0; x < image.width; x++) {
+			row[x * 4 + 0] = src[x * 4 + 2];
+			row[x * 4 + 1] = src[x * 4 + 1];
+			row[x * 4 + 2] = src[x * 4 + 0];
+			row[x * 4 + 3] = src[x * 4 + 3];
+		}
+		file.write((char*)row, image.width * 4);
+	}
+	delete[] row;
+
+	return (bool)file;
+}
+
+void cleanup(Image& image) {
+	delete[] image.pixels;
+	image.pixels = nullptr;
+}
+
+// Where a sprite lives in the atlas (in UVs) and how big it was originally (in pixels)
+struct Sprite {
+	vec2d uvMin;
+	vec2d uvMax;
+	vec2d size;
+};
+
+// The skyline packer keeps track of the "roof" of everything packed so far as a list
+// of horizontal segments, and drops each new rect as low as it can go (bottom left rule)
+struct SkylineNode {
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+};
+
+const unsigned int maxSkylineNodes = 1024;
+const unsigned int maxSprites = 1024;
+
+// All the sprite images packed into one texture, so every sprite can share one bind and one draw
+struct Atlas {
+	Image image;
+	SkylineNode nodes[maxSkylineNodes];
+	unsigned int noNodes;
+	Sprite sprites[maxSprites];
+	unsigned int noSprites;
+	GLuint texture;
+};
+
+void genAtlas(Atlas& atlas, unsigned int width, unsigned int height) {
+	atlas.image.width = width;
+	atlas.image.height = height;
+	atlas.image.pixels = new unsigned char[width * height * 4];
+	memset(atlas.image.pixels, 0, width * height * 4);
+
+	atlas.nodes[0] = { 0, 0, width };
+	atlas.noNodes = 1;
+	atlas.noSprites = 0;
+	atlas.texture = 0;
+}
+
+// Would a w x h rect sitting on node idx fit? If so y is how high it ends up
+bool skylineFit(Atlas& atlas, unsigned int idx, unsigned int w, unsigned int h, unsigned int& y) {
+	if (atlas.nodes[idx].x + w > atlas.image.width) {
+		return false;
+	}
+
+	// The rect has to sit on top of the highest node it spans
+	y = 0;
+	unsigned int widthLeft = w;
+	for (unsigned int i = idx; i < atlas.noNodes; i++) {
+		y = max(y, atlas.nodes[i].y);
+		if (y + h > atlas.image.height) {
+			return false;
+		}
+		if (atlas.nodes[i].width >= widthLeft) {
+			return true;
+		}
+		widthLeft -= atlas.nodes[i].width;
+	}
+
+	return false;
+}
+
+// Find a spot for a w x h rect, returns false if the atlas is full
+bool packRect(Atlas& atlas, unsigned int w, unsigned int h, unsigned int& outX, unsigned int& outY) {
+	unsigned int bestIdx = atlas.noNodes;
+	unsigned int bestY = 0;
+	unsigned int bestWidth = 0;
+
+	for (unsigned int i = 0; i < atlas.noNodes; i++) {
+		unsigned int y;
+		if (skylineFit(atlas, i, w, h, y)) {
+			if (bestIdx == atlas.noNodes || y < bestY || (y == bestY && atlas.nodes[i].width < bestWidth)) {
+				bestIdx = i;
+				bestY = y;
+				bestWidth = atlas.nodes[i].width;
+			}
+		}
+	}
+
+	if (bestIdx == atlas.noNodes || atlas.noNodes >= maxSkylineNodes) {
+		return false;
+	}
+
+	outX = atlas.nodes[bestIdx].x;
+	outY = bestY;
+
+	// The new rect's top becomes a new piece of skyline
+	memmove(&atlas.nodes[bestIdx + 1], &atlas.nodes[bestIdx], (atlas.noNodes - bestIdx) * sizeof(SkylineNode));
+	atlas.nodes[bestIdx] = { outX, bestY + h, w };
+	atlas.noNodes++;
+
+	// Anything it covers gets shrunk or removed
+	unsigned int i = bestIdx + 1;
+	while (i < atlas.noNodes) {
+		SkylineNode& prev = atlas.nodes[i - 1];
+		SkylineNode& node = atlas.nodes[i];
+		unsigned int prevEnd = prev.x + prev.width;
+		if (node.x >= prevEnd) {
+			break;
+		}
+
+		unsigned int shrink = prevEnd - node.x;
+		if (node.width > shrink) {
+			node.x += shrink;
+			node.width -= shrink;
+			break;
+		}
+
+		memmove(&atlas.nodes[i], &atlas.nodes[i + 1], (atlas.noNodes - i - 1) * sizeof(SkylineNode));
+		atlas.noNodes--;
+	}
+
+	// Merge neighbours at the same height
+	i = 0;
+	while (i + 1 < atlas.noNodes) {
+		if (atlas.nodes[i].y == atlas.nodes[i + 1].y) {
+			atlas.nodes[i].width += atlas.nodes[i + 1].width;
+			memmove(&atlas.nodes[i + 1], &atlas.nodes[i + 2], (atlas.noNodes - i - 2) * sizeof(SkylineNode));
+			atlas.noNodes--;
+		}
+		else {
+			i++;
+		}
+	}
+
+	return true;
+}
+
+// Pack an image into the atlas, returns the sprite id or -1 if it didn't fit
+// Each sprite gets a 1 pixel border copied from its edges so linear filtering
+// doesn't bleed in its neighbours
+int addSprite(Atlas& atlas, Image& image) {
+	unsigned int x, y;
+	if (atlas.noSprites >= maxSprites || !packRect(atlas, image.width + 2, image.height + 2, x, y)) {
+		cout << "Sprite does not fit in the atlas" << endl;
+		return -1;
+	}
+
+	for (unsigned int row = 0; row < image.height + 2; row++) {
+		unsigned int srcRow = min(max(row, 1u) - 1, image.height - 1);
+		for (unsigned int col = 0; col < image.width + 2; col++) {
+			unsigned int srcCol = min(max(col, 1u) - 1, image.width - 1);
+			memcpy(atlas.image.pixels + ((y + row) * atlas.image.width + x + col) * 4,
+				image.pixels + (srcRow * image.width + srcCol) * 4, 4);
+		}
+	}
+
+	float atlasW = (float)atlas.image.width;
+	float atlasH = (float)atlas.image.height;
+	atlas.sprites[atlas.noSprites] = {
+		{ (x + 1) / atlasW, (y + 1) / atlasH },
+		{ (x + 1 + image.width) / atlasW, (y + 1 + image.height) / atlasH },
+		{ (float)image.width, (float)image.height }
+	};
+
+	return atlas.noSprites++;
+}
+
+// Check a file is there before trying to load it (for optional assets)
+bool fileExists(const char* filename) {
+	ifstream file(filename);
+	return file.is_open();
+}
+
+// Add a plain white sprite, handy for drawing flat coloured rects through the sprite batch
+int addWhiteSprite(Atlas& atlas) {
+	unsigned char white[4] = { 255, 255, 255, 255 };
+	Image image = { 1, 1, white };
+	return addSprite(atlas, image);
+}
+
+// Upload the packed atlas, call once after everything has been added
+void genAtlasTexture(Atlas& atlas) {
+	glGenTextures(1, &atlas.texture);
+	glBindTexture(GL_TEXTURE_2D, atlas.texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, atlas.image.width, atlas.image.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, atlas.image.pixels);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void cleanup(Atlas& atlas) {
+	glDeleteTextures(1, &atlas.texture);
+	cleanup(atlas.image);
+}
+
+// What each sprite instance sends to sprite.vs
+struct SpriteInstance {
+	vec2d offset;
+	vec2d size;
+	vec2d uvMin;
+	vec2d uvMax;
+	rgba color;
+};
+
+const GLuint spriteInstanceStride = sizeof(SpriteInstance) / sizeof(float);
+
+// Collects sprites for a frame and draws them all with one texture bind and one instanced draw
+struct SpriteBatch {
+	VAO vao;
+	SpriteInstance* instances;
+	unsigned int noInstances;
+	unsigned int maxInstances;
+};
+
+void genSpriteBatch(SpriteBatch& batch, unsigned int maxInstances) {
+	float quadVertices[] = {
+		0.5f, 0.5f,
+		-0.5f, 0.5f,
+		-0.5f, -0.5f,
+		0.5f, -0.5f
+	};
+
+	unsigned int quadIndices[] = {
+		0, 1, 2,
+		2, 3, 0
+	};
+
+	genVAO(&batch.vao);
+
+	genBufferObject<float>(batch.vao.posVBO, GL_ARRAY_BUFFER, 2 * 4, quadVertices, GL_STATIC_DRAW);
+	setAttPointer<float>(batch.vao.posVBO, 0, 2, GL_FLOAT, 2, 0);
+
+	genBufferObject<SpriteInstance>(batch.vao.instanceVBO, GL_ARRAY_BUFFER, maxInstances, nullptr, GL_DYNAMIC_DRAW);
+	setAttPointer<float>(batch.vao.instanceVBO, 1, 2, GL_FLOAT, spriteInstanceStride, 0, 1);
+	setAttPointer<float>(batch.vao.instanceVBO, 2, 2, GL_FLOAT, spriteInstanceStride, 2, 1);
+	setAttPointer<float>(batch.vao.instanceVBO, 3, 2, GL_FLOAT, spriteInstanceStride, 4, 1);
+	setAttPointer<float>(batch.vao.instanceVBO, 4, 2, GL_FLOAT, spriteInstanceStride, 6, 1);
+	setAttPointer<float>(batch.vao.instanceVBO, 5, 4, GL_FLOAT, spriteInstanceStride, 8, 1);
+
+	genBufferObject<GLuint>(batch.vao.EBO, GL_ELEMENT_ARRAY_BUFFER, 2 * 3, quadIndices, GL_STATIC_DRAW);
+
+	unbindBuffer(GL_ARRAY_BUFFER);
+	unbindVAO();
+
+	batch.instances = new SpriteInstance[maxInstances];
+	batch.noInstances = 0;
+	batch.maxInstances = maxInstances;
+}
+
+// Queue a sprite, pos is the center and size is in pixels
+void drawSprite(SpriteBatch& batch, Atlas& atlas, unsigned int sprite, vec2d pos, vec2d size, rgba color) {
+	if (batch.noInstances >= batch.maxInstances) {
+		return;
+	}
+
+	Sprite& s = atlas.sprites[sprite];
+	batch.instances[batch.noInstances++] = { pos, size, s.uvMin, s.uvMax, color };
+}
+
+// A whole texture that isn't in the atlas, flush it with that texture before drawing anything else
+void drawImage(SpriteBatch& batch, vec2d pos, vec2d size, rgba color) {
+	if (batch.noInstances >= batch.maxInstances) {
+		return;
+	}
+
+	batch.instances[batch.noInstances++] = { pos, size, { 0.0f, 0.0f }, { 1.0f, 1.0f }, color };
+}
+
+// Record everything queued this frame as one bind + upload + draw
+void flushSprites(SpriteBatch& batch, GLuint texture, GLuint program, CommandBuffer& cb) {
+	if (batch.noInstances == 0) {
+		return;
+	}
+
+	cmdBindShader(cb, program);
+	cmdBindTexture(cb, texture);
+	cmdUpload<SpriteInstance>(cb, batch.vao.instanceVBO, 0, batch.noInstances, batch.instances);
+	cmdDraw(cb, batch.vao, GL_TRIANGLES, 3 * 2, GL_UNSIGNED_INT, 0, batch.noInstances);
+
+	batch.noInstances = 0;
+}
+
+void flushSprites(SpriteBatch& batch, Atlas& atlas, GLuint program, CommandBuffer& cb) {
+	flushSprites(batch, atlas.texture, program, cb);
+}
+
+void cleanup(SpriteBatch& batch) {
+	cleanup(batch.vao);
+	delete[] batch.instances;
+}
+
+//
+// Text
+//
+
+// Tiny 5x7 bitmap font, each row is 5 bits with the leftmost pixel as the top bit
+// Rows go from top to bottom. Lowercase gets drawn as uppercase.
+const char fontChars[] = " 0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ-:.%/()+=!?,_<>#";
+const unsigned char fontGlyphs[][7] = {
+	{ 0b00000, 0b00000, 0b00000, 0b00000, 0b00000, 0b00000, 0b00000 }, // space
+	{ 0b01110, 0b10001, 0b10011, 0b10101, 0b11001, 0b10001, 0b01110 }, // 0
+	{ 0b00100, 0b01100, 0b00100, 0b00100, 0b00100, 0b00100, 0b01110 }, // 1
+	{ 0b01110, 0b10001, 0b00001, 0b00010, 0b00100, 0b01000, 0b11111 }, // 2
+	{ 0b11111, 0b00010, 0b00100, 0b00010, 0b00001, 0b10001, 0b01110 }, // 3
+	{ 0b00010, 0b00110, 0b01010, 0b10010, 0b11111, 0b00010, 0b00010 }, // 4
+	{ 0b11111, 0b10000, 0b11110, 0b00001, 0b00001, 0b10001, 0b01110 }, // 5
+	{ 0b00110, 0b01000, 0b10000, 0b11110, 0b10001, 0b10001, 0b01110 }, // 6
+	{ 0b11111, 0b00001, 0b00010, 0b00100, 0b01000, 0b01000, 0b01000 }, // 7
+	{ 0b01110, 0b10001, 0b10001, 0b01110, 0b10001, 0b10001, 0b01110 }, // 8
+	{ 0b01110, 0b10001, 0b10001, 0b01111, 0b00001, 0b00010, 0b01100 }, // 9
+	{ 0b01110, 0b10001, 0b10001, 0b11111, 0b10001, 0b10001, 0b10001 }, // A
+	{ 0b11110, 0b10001, 0b10001, 0b11110, 0b10001, 0b10001, 0b11110 }, // B
+	{ 0b01110, 0b10001, 0b10000, 0b10000, 0b10000, 0b10001, 0b01110 }, // C
+	{ 0b11100, 0b10010, 0b10001, 0b10001, 0b10001, 0b10010, 0b11100 }, // D
+	{ 0b11111, 0b10000, 0b10000, 0b11110, 0b10000, 0b10000, 0b11111 }, // E
+	{ 0b11111, 0b10000, 0b10000, 0b11110, 0b10000, 0b10000, 0b10000 }, // F
+	{ 0b01110, 0b10001, 0b10000, 0b10111, 0b10001, 0b10001, 0b01111 }, // G
+	{ 0b10001, 0b10001, 0b10001, 0b11111, 0b10001, 0b10001, 0b10001 }, // H
+	{ 0b01110, 0b00100, 0b00100, 0b00100, 0b00100, 0b00100, 0b01110 }, // I
+	{ 0b00111, 0b00010, 0b00010, 0b00010, 0b00010, 0b10010, 0b01100 }, // J
+	{ 0b10001, 0b10010, 0b10100, 0b11000, 0b10100, 0b10010, 0b10001 }, // K
+	{ 0b10000, 0b10000, 0b10000, 0b10000, 0b10000, 0b10000, 0b11111 }, // L
+	{ 0b10001, 0b11011, 0b10101, 0b10101, 0b10001, 0b10001, 0b10001 }, // M
+	{ 0b10001, 0b10001, 0b11001, 0b10101, 0b10011, 0b10001, 0b10001 }, // N
+	{ 0b01110, 0b10001, 0b10001, 0b10001, 0b10001, 0b10001, 0b01110 }, // O
+	{ 0b11110, 0b10001, 0b10001, 0b11110, 0b10000, 0b10000, 0b10000 }, // P
+	{ 0b01110, 0b10001, 0b10001, 0b10001, 0b10101, 0b10010, 0b01101 }, // Q
+	{ 0b11110, 0b10001, 0b10001, 0b11110, 0b10100, 0b10010, 0b10001 }, // R
+	{ 0b01111, 0b10000, 0b10000, 0b01110, 0b00001, 0b00001, 0b11110 }, // S
+	{ 0b11111, 0b00100, 0b00100, 0b00100, 0b00100, 0b00100, 0b00100 }, // T
+	{ 0b10001, 0b10001, 0b10001, 0b10001, 0b10001, 0b10001, 0b01110 }, // U
+	{ 0b10001, 0b10001, 0b10001, 0b10001, 0b10001, 0b01010, 0b00100 }, // V
+	{ 0b10001, 0b10001, 0b10001, 0b10101, 0b10101, 0b10101, 0b01010 }, // W
+	{ 0b10001, 0b10001, 0b01010, 0b00100, 0b01010, 0b10001, 0b10001 }, // X
+	{ 0b10001, 0b10001, 0b10001, 0b01010, 0b00100, 0b00100, 0b00100 }, // Y
+	{ 0b11111, 0b00001, 0b00010, 0b00100, 0b01000, 0b10000, 0b11111 }, // Z
+	{ 0b00000, 0b00000, 0b00000, 0b11111, 0b00000, 0b00000, 0b00000 }, // -
+	{ 0b00000, 0b01100, 0b01100, 0b00000, 0b01100, 0b01100, 0b00000 }, // :
+	{ 0b00000, 0b00000, 0b00000, 0b00000, 0b00000, 0b01100, 0b01100 }, // .
+	{ 0b11000, 0b11001, 0b00010, 0b00100, 0b01000, 0b10011, 0b00011 }, // %
+	{ 0b00000, 0b00001, 0b00010, 0b00100, 0b01000, 0b10000, 0b00000 }, // /
+	{ 0b00010, 0b00100, 0b01000, 0b01000, 0b01000, 0b00100, 0b00010 }, // (
+	{ 0b01000, 0b00100, 0b00010, 0b00010, 0b00010, 0b00100, 0b01000 }, // )
+	{ 0b00000, 0b00100, 0b00100, 0b11111, 0b00100, 0b00100, 0b00000 }, // +
+	{ 0b00000, 0b00000, 0b11111, 0b00000, 0b11111, 0b00000, 0b00000 }, // =
+	{ 0b00100, 0b00100, 0b00100, 0b00100, 0b00100, 0b00000, 0b00100 }, // !
+	{ 0b01110, 0b10001, 0b00001, 0b00010, 0b00100, 0b00000, 0b00100 }, // ?
+	{ 0b00000, 0b00000, 0b00000, 0b00000, 0b01100, 0b00100, 0b01000 }, // ,
+	{ 0b00000, 0b00000, 0b00000, 0b00000, 0b00000, 0b00000, 0b11111 }, // _
+	{ 0b00010, 0b00100, 0b01000, 0b10000, 0b01000, 0b00100, 0b00010 }, // <
+	{ 0b01000, 0b00100, 0b00010, 0b00001, 0b00010, 0b00100, 0b01000 }, // >
+	{ 0b01010, 0b01010, 0b11111, 0b01010, 0b11111, 0b01010, 0b01010 }  // #
+};
+
+const unsigned int glyphCols = 5;
+const unsigned int glyphRows = 7;
+
+// Which atlas sprite each ASCII char uses (-1 if we don't have it)
+struct Font {
+	int glyphs[128];
+};
+
+// Rasterize the bitmap font into the atlas, once at load time
+// scale is how many texels each font pixel becomes, so it still looks OK with linear filtering
+void genFont(Font& font, Atlas& atlas, unsigned int scale) {
+	for (unsigned int c = 0; c < 128; c++) {
+		font.glyphs[c] = -1;
+	}
+
+	Image glyph;
+	glyph.width = glyphCols * scale;
+	glyph.height = glyphRows * scale;
+	glyph.pixels = new unsigned char[glyph.width * glyph.height * 4];
+
+	for (unsigned int g = 0; fontChars[g] != '\0'; g++) {
+		for (unsigned int y = 0; y < glyph.height; y++) {
+			// Image rows go bottom to top but the font data goes top to bottom
+			unsigned char bits = fontGlyphs[g][glyphRows - 1 - y / scale];
+			for (unsigned int x = 0; x < glyph.width; x++) {
+				bool on = (bits >> (glyphCols - 1 - x / scale)) & 1;
+				unsigned char* px = glyph.pixels + (y * glyph.width + x) * 4;
+				px[0] = px[1] = px[2] = 255;
+				px[3] = on ? 255 : 0;
+			}
+		}
+
+		font.glyphs[(unsigned char)fontChars[g]] = addSprite(atlas, glyph);
+	}
+
+	cleanup(glyph);
+}
+
+// Glyph cells are 6 font pixels wide (5 + 1 for spacing) and 7 tall
+float textWidth(const char* text, float height) {
+	return strlen(text) * height * (glyphCols + 1) / glyphRows;
+}
+
+const unsigned int maxTextLength = 64;
+const unsigned int maxTextItems = 32;
+
+// One string on screen
+struct TextItem {
+	char text[maxTextLength];
+	vec2d pos; // Bottom left of the first glyph
+	float height; // In pixels
+	rgba color;
+};
+
+// All the strings for a layer (e.g. the HUD). Strings only get laid out into glyph
+// instances when one of them actually changes, otherwise we keep drawing the
+// instances already sitting in the VBO with one instanced draw.
+struct TextLayer {
+	SpriteBatch batch;
+	TextItem items[maxTextItems];
+	unsigned int noItems;
+	bool dirty;
+};
+
+void genTextLayer(TextLayer& layer, unsigned int maxGlyphs) {
+	genSpriteBatch(layer.batch, maxGlyphs);
+	layer.noItems = 0;
+	layer.dirty = false;
+}
+
+// Set string idx of the layer, only marks the layer dirty if something is different
+void setText(TextLayer& layer, unsigned int idx, const char* text, vec2d pos, float height, rgba color) {
+	if (idx >= maxTextItems) {
+		return;
+	}
+
+	TextItem& item = layer.items[idx];
+	if (idx < layer.noItems && strcmp(item.text, text) == 0
+		&& item.pos.x == pos.x && item.pos.y == pos.y && item.height == height
+		&& memcmp(&item.color, &color, sizeof(rgba)) == 0) {
+		return;
+	}
+
+	unsigned int len = min((unsigned int)strlen(text), maxTextLength - 1);
+	memcpy(item.text, text, len);
+	item.text[len] = '\0';
+	item.pos = pos;
+	item.height = height;
+	item.color = color;
+
+	// Any items we skipped over start out empty
+	for (unsigned int i = layer.noItems; i < idx; i++) {
+		layer.items[i].text[0] = '\0';
+	}
+	layer.noItems = max(layer.noItems, idx + 1);
+	layer.dirty = true;
+}
+
+// Turn every string into glyph instances
+void layoutText(TextLayer& layer, Font& font, Atlas& atlas) {
+	layer.batch.noInstances = 0;
+
+	for (unsigned int i = 0; i < layer.noItems; i++) {
+		TextItem& item = layer.items[i];
+		float unit = item.height / glyphRows; // Size of one font pixel
+		vec2d size = { glyphCols * unit, item.height };
+		float x = item.pos.x + size.x / 2.0f;
+		float y = item.pos.y + size.y / 2.0f;
+
+		for (const char* c = item.text; *c != '\0'; c++) {
+			unsigned char ch = (unsigned char)toupper((unsigned char)*c);
+			if (ch < 128 && font.glyphs[ch] >= 0 && ch != ' ') {
+				drawSprite(layer.batch, atlas, font.glyphs[ch], { x, y }, size, item.color);
+			}
+			x += (glyphCols + 1) * unit;
+		}
+	}
+
+	layer.dirty = false;
+}
+
+// Record the layer's draw, the glyph instances only get re-uploaded if the text changed
+void flushText(TextLayer& layer, Font& font, Atlas& atlas, GLuint program, CommandBuffer& cb) {
+	if (layer.dirty) {
+		layoutText(layer, font, atlas);
+		cmdUpload<SpriteInstance>(cb, layer.batch.vao.instanceVBO, 0, layer.batch.noInstances, layer.batch.instances);
+	}
+
+	if (layer.batch.noInstances == 0) {
+		return;
+	}
+
+	cmdBindShader(cb, program);
+	cmdBindTexture(cb, atlas.texture);
+	cmdDraw(cb, layer.batch.vao, GL_TRIANGLES, 3 * 2, GL_UNSIGNED_INT, 0, layer.batch.noInstances);
+}
+
+void cleanup(TextLayer& layer) {
+	cleanup(layer.batch);
+}
+
+// HUD strings, there's just the score for now
+TextLayer hudText;
+const unsigned int scoreTextItem = 0;
+const float scoreTextHeight = 28.0f;
+
+//
+// Performance Overlay
+//
+
+// Frame time graph and counters drawn on top of the game (F3 to toggle)
+// The graph is one sprite per frame through the sprite batch and the numbers
+// only get re-laid out a few times a second, so leaving it on costs next to nothing.
+const unsigned int overlayHistory = 240; // Frames in the graph
+const double overlayTextInterval = 0.25; // Seconds between text updates
+const float overlayTextHeight = 14.0f;
+const float overlayGraphHeight = 80.0f;
+const float overlayMsPerPixel = 0.25f; // So 20ms fills the graph
+
+struct PerfOverlay {
+	bool visible;
+	float frameMs[overlayHistory]; // Ring of recent frame times
+	unsigned int next;
+	unsigned int count;
+	FrameStats stats; // Last finished frame
+	double lastTextUpdate;
+	SpriteBatch graph;
+	TextLayer text;
+};
+
+PerfOverlay perfOverlay;
+
+void genPerfOverlay(PerfOverlay& overlay) {
+	overlay.visible = false;
+	overlay.next = 0;
+	overlay.count = 0;
+	overlay.stats = { 0, 0, 0, 0, 0 };
+	overlay.lastTextUpdate = 0.0;
+	genSpriteBatch(overlay.graph, overlayHistory + 2);
+	genTextLayer(overlay.text, 512);
+}
+
+// Record a finished frame
+void perfOverlayAddFrame(PerfOverlay& overlay, float ms, FrameStats stats) {
+	overlay.frameMs[overlay.next] = ms;
+	overlay.next = (overlay.next + 1) % overlayHistory;
+	overlay.count = min(overlay.count + 1, overlayHistory);
+	overlay.stats = stats;
+}
+
+// p is from 0 to 1, sorted has to be sorted
+float percentile(float* sorted, unsigned int count, float p) {
+	if (count == 0) {
+		return 0.0f;
+	}
+	return sorted[min((unsigned int)(p * (count - 1) + 0.5f), count - 1)];
+}
+
+void updatePerfOverlayText(PerfOverlay& overlay) {
+	float sorted[overlayHistory];
+	memcpy(sorted, overlay.frameMs, overlay.count * sizeof(float));
+	sort(sorted, sorted + overlay.count);
+
+	float x = 10.0f;
+	float y = scrHeight - overlayTextHeight - 10.0f;
+	float lineHeight = overlayTextHeight + 6.0f;
+	rgba color = { 1.0f, 1.0f, 0.6f, 1.0f };
+	char line[maxTextLength];
+
+	float last = overlay.frameMs[(overlay.next + overlayHistory - 1) % overlayHistory];
+	snprintf(line, maxTextLength, "CPU %.2f MS  GPU %.2f MS", last, gpuTimer.frameMs);
+	setText(overlay.text, 0, line, { x, y }, overlayTextHeight, color);
+
+	snprintf(line, maxTextLength, "P50 %.2f  P95 %.2f  P99 %.2f  MAX %.2f",
+		percentile(sorted, overlay.count, 0.5f), percentile(sorted, overlay.count, 0.95f),
+		percentile(sorted, overlay.count, 0.99f), percentile(sorted, overlay.count, 1.0f));
+	setText(overlay.text, 1, line, { x, y - lineHeight }, overlayTextHeight, color);
+
+	snprintf(line, maxTextLength, "DRAWS %u  GL CALLS %u  INSTANCES %u",
+		overlay.stats.drawCalls, overlay.stats.glCalls, overlay.stats.instances);
+	setText(overlay.text, 2, line, { x, y - 2 * lineHeight }, overlayTextHeight, color);
+
+	snprintf(line, maxTextLength, "UPLOAD %u B  ALLOCS %u", overlay.stats.uploadBytes, overlay.stats.allocations);
+	setText(overlay.text, 3, line, { x, y - 3 * lineHeight }, overlayTextHeight, color);
+}
+
+// Record the overlay's draws, now is the current time in seconds
+void drawPerfOverlay(PerfOverlay& overlay, Font& font, Atlas& atlas, int whiteSprite, GLuint program, CommandBuffer& cb, double now) {
+	if (!overlay.visible) {
+		return;
+	}
+
+	if (now - overlay.lastTextUpdate >= overlayTextInterval) {
+		updatePerfOverlayText(overlay);
+		overlay.lastTextUpdate = now;
+	}
+
+	// Graph background and a line at 60fps
+	float left = 10.0f;
+	float bottom = 10.0f;
+	drawSprite(overlay.graph, atlas, whiteSprite, { left + overlayHistory / 2.0f, bottom + overlayGraphHeight / 2.0f },
+		{ (float)overlayHistory, overlayGraphHeight }, { 0.0f, 0.0f, 0.0f, 0.6f });
+	drawSprite(overlay.graph, atlas, whiteSprite, { left + overlayHistory / 2.0f, bottom + 16.67f / overlayMsPerPixel },
+		{ (float)overlayHistory, 1.0f }, { 0.3f, 0.3f, 1.0f, 1.0f });
+
+	// One bar per frame, oldest on the left
+	for (unsigned int i = 0; i < overlay.count; i++) {
+		float ms = overlay.frameMs[(overlay.next + overlayHistory - overlay.count + i) % overlayHistory];
+		float h = min(ms / overlayMsPerPixel, overlayGraphHeight);
+		rgba color = ms < 17.0f ? rgba{ 0.2f, 1.0f, 0.2f, 1.0f } : ms < 34.0f ? rgba{ 1.0f, 1.0f, 0.2f, 1.0f } : rgba{ 1.0f, 0.2f, 0.2f, 1.0f };
+		drawSprite(overlay.graph, atlas, whiteSprite, { left + i + 0.5f, bottom + h / 2.0f }, { 1.0f, h }, color);
+	}
+
+	flushSprites(overlay.graph, atlas, program, cb);
+	flushText(overlay.text, font, atlas, program, cb);
+}
+
+void cleanup(PerfOverlay& overlay) {
+	cleanup(overlay.graph);
+	cleanup(overlay.text);
+}
+
+//
+// Sampling Profiler
+//
+
+// Statistical profiler for long runs: SIGPROF fires every so often on whichever
+// thread is burning CPU, and the handler walks the frame pointers into a
+// preallocated buffer (no locks, no allocations, just an atomic slot counter).
+// Symbolizing and building the reports happens after we stop.
+// Linux only, and it needs -fno-omit-frame-pointer (and -rdynamic for names). The
+// vcxproj only builds for Windows, so on Linux (with GLFW 3.4 installed) build it
+// from MoEngine/ with:
+//   gcc -O2 -I../Linking/include -c glad.c -o glad.o
+//   g++ -std=c++14 -O2 -g -fno-omit-frame-pointer -rdynamic -I../Linking/include main.cpp glad.o -o MoEngine -lglfw -ldl -lpthread
+// and run it from there too so it finds the shaders (./MoEngine --sample-profile, --perf-counters).
+const unsigned int maxSampleDepth = 48;
+const unsigned int maxSamples = 1 << 17;
+
+struct Sample {
+	unsigned int depth;
+	void* pcs[maxSampleDepth]; // Leaf first
+};
+
+Sample* samples = nullptr;
+atomic<unsigned int> noSamples(0);
+atomic<unsigned int> droppedSamples(0);
+
+#ifdef __linux__
+
+// This thread's stack, so the walk never follows a frame pointer off the end of it
+// Looked up once when the thread starts (pthread_getattr_np allocates, so not in the handler).
+// Threads we didn't start, like the GL driver's, stay at 0 and only get their pc recorded.
+thread_local uintptr_t sampleStackLow = 0;
+thread_local uintptr_t sampleStackHigh = 0;
+
+// Call at the start of every thread of ours that we want full stacks for
+void samplerRegisterThread() {
+	pthread_attr_t attr;
+	if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+		return;
+	}
+
+	void* base = nullptr;
+	size_t size = 0;
+	if (pthread_attr_getstack(&attr, &base, &size) == 0) {
+		sampleStackLow = (uintptr_t)base;
+		sampleStackHigh = (uintptr_t)base + size;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+void sampleHandler(int /*sig*/, siginfo_t* /*info*/, void* context) {
+	unsigned int idx = noSamples.fetch_add(1, memory_order_relaxed);
+	if (idx >= maxSamples) {
+		droppedSamples.fetch_add(1, memory_order_relaxed);
+		return;
+	}
+
+	ucontext_t* uc = (ucontext_t*)context;
+	uintptr_t pc = 0;
+	uintptr_t fp = 0;
+	uintptr_t sp = 0;
+#if defined(__x86_64__)
+	pc = uc->uc_mcontext.gregs[REG_RIP];
+	fp = uc->uc_mcontext.gregs[REG_RBP];
+	sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+	pc = uc->uc_mcontext.pc;
+	fp = uc->uc_mcontext.regs[29];
+	sp = uc->uc_mcontext.sp;
+#endif
+
+	Sample& sample = samples[idx];
+	sample.pcs[0] = (void*)pc;
+	sample.depth = 1;
+
+	// Each frame starts with [caller's frame pointer, return address]
+	// Code built without frame pointers (libc, the GL driver) leaves whatever it likes in the
+	// frame pointer register, so only follow it while it points into this thread's stack above
+	// sp and keeps going up, otherwise we'd fault inside the signal handler
+	if (sp < sampleStackLow || sp >= sampleStackHigh) {
+		return; // Not a thread we know the stack of
+	}
+	while (sample.depth < maxSampleDepth && (fp & (sizeof(void*) - 1)) == 0 && fp >= sp && fp <= sampleStackHigh - 2 * sizeof(uintptr_t)) {
+		uintptr_t* frame = (uintptr_t*)fp;
+		uintptr_t next = frame[0];
+		uintptr_t ret = frame[1];
+		if (ret == 0) {
+			break;
+		}
+
+		sample.pcs[sample.depth++] = (void*)ret;
+		if (next <= fp) {
+			break;
+		}
+		fp = next;
+	}
+}
+
+// Start sampling at hz samples per second of CPU time
+// Call it on the main thread, which it registers
+bool startSamplingProfiler(unsigned int hz) {
+	samplerRegisterThread();
+	if (!samples) {
+		samples = new Sample[maxSamples];
+	}
+	noSamples.store(0);
+	droppedSamples.store(0);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = sampleHandler;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGPROF, &action, nullptr) != 0) {
+		cout << "Could not install the SIGPROF handler" << endl;
+		return false;
+	}
+
+	itimerval timer;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 1000000 / hz;
+	timer.it_value = timer.it_interval;
+	return setitimer(ITIMER_PROF, &timer, nullptr) == 0;
+}
+
+void stopSamplingProfiler() {
+	itimerval timer;
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, nullptr);
+	signal(SIGPROF, SIG_IGN);
+}
+
+// Function name for an address (demangled if possible, otherwise module+offset)
+string symbolize(void* pc) {
+	Dl_info info;
+	if (dladdr(pc, &info) && info.dli_sname) {
+		int status = 0;
+		char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+		string name = status == 0 && demangled ? demangled : info.dli_sname;
+		free(demangled);
+		return name;
+	}
+
+	char buf[64];
+	if (dladdr(pc, &info) && info.dli_fname) {
+		const char* module = strrchr(info.dli_fname, '/');
+		snprintf(buf, sizeof(buf), "%s+0x%lx", module ? module + 1 : info.dli_fname, (unsigned long)((char*)pc - (char*)info.dli_fbase));
+	}
+	else {
+		snprintf(buf, sizeof(buf), "0x%lx", (unsigned long)pc);
+	}
+	return buf;
+}
+
+// Writes <prefix>.folded (one "root;...;leaf count" line per unique stack, for flamegraph.pl
+// or speedscope) and <prefix>.txt (flat self/total report per function)
+void writeSamplingReport(const char* prefix) {
+	unsigned int count = min(noSamples.load(), maxSamples);
+	map<void*, string> names;
+	map<string, unsigned int> folded;
+	map<string, unsigned int> self;
+	map<string, unsigned int> total;
+
+	for (unsigned int i = 0; i < count; i++) {
+		Sample& sample = samples[i];
+		vector<string> stack;
+
+		for (unsigned int d = 0; d < sample.depth; d++) {
+			// Return addresses point after the call, step back into it so we land on the right line/function
+			void* pc = d == 0 ? sample.pcs[d] : (void*)((char*)sample.pcs[d] - 1);
+			map<void*, string>::iterator it = names.find(pc);
+			if (it == names.end()) {
+				it = names.insert(make_pair(pc, symbolize(pc))).first;
+			}
+			stack.push_back(it->second);
+		}
+
+		string line;
+		for (unsigned int d = sample.depth; d-- > 0;) {
+			line += stack[d];
+			if (d > 0) {
+				line += ";";
+			}
+		}
+		folded[line]++;
+		self[stack[0]]++;
+
+		// Recursive functions only count once per sample
+		sort(stack.begin(), stack.end());
+		stack.erase(unique(stack.begin(), stack.end()), stack.end());
+		for (unsigned int d = 0; d < stack.size(); d++) {
+			total[stack[d]]++;
+		}
+	}
+
+	string foldedName = string(prefix) + ".folded";
+	ofstream foldedFile(foldedName.c_str());
+	for (map<string, unsigned int>::iterator it = folded.begin(); it != folded.end(); it++) {
+		foldedFile << it->first << " " << it->second << "\n";
+	}
+
+	// Flat report, hottest self time first
+	vector<pair<unsigned int, string> > flat;
+	for (map<string, unsigned int>::iterator it = self.begin(); it != self.end(); it++) {
+		flat.push_back(make_pair(it->second, it->first));
+	}
+	sort(flat.rbegin(), flat.rend());
+
+	string reportName = string(prefix) + ".txt";
+	ofstream report(reportName.c_str());
+	report << count << " samples (" << droppedSamples.load() << " dropped)\n\n";
+	report << "   self%   total%  function\n";
+	for (unsigned int i = 0; i < flat.size(); i++) {
+		char line[64];
+		snprintf(line, sizeof(line), "%7.2f%% %7.2f%%  ", 100.0 * flat[i].first / count, 100.0 * total[flat[i].second] / count);
+		report << line << flat[i].second << "\n";
+	}
+
+	cout << "Wrote " << foldedName << " and " << reportName << "\n";
+}
+
+#else
+
+void samplerRegisterThread() {
+}
+
+bool startSamplingProfiler(unsigned int hz) {
+	cout << "The sampling profiler is only supported on Linux" << endl;
+	return false;
+}
+
+void stopSamplingProfiler() {
+}
+
+void writeSamplingReport(const char* prefix) {
+}
+
+#endif
+
+//
+// Flight Recorder
+//
+
+// Always running, fixed size record of the last few seconds: frame times, which actions
+// were down and a hash of the game state every frame, plus every key event gatherInput
+// drained with its timestamp. The profiler rings already hold the zones. When a frame
+// goes over budget (--flight-budget, a fixed number of ms or a multiple of the normal
+// frame interval) we write all of it out as a trace, so we get the lead up to hitches
+// that never show up while someone is watching. Writing the trace is slow, so the game
+// thread only copies the frames out and a dump thread turns them into JSON.
+const unsigned int flightRecorderFrames = 1024; // About 17 seconds at 60fps
+const unsigned int flightRecorderInputs = 1024;
+const float flightRecorderDefaultFactor = 2.0f;
+const double flightRecorderCooldown = 5.0; // Seconds between dumps so one bad patch doesn't write 50 files
+const unsigned int flightRecorderWarmup = 120; // Frames to let the interval estimate settle
+
+struct FlightFrame {
+	uint64_t start; // profilerNow() when the frame started
+	float ms;
+	unsigned int actions;
+	uint32_t stateHash;
+	unsigned int frame; // Profiler frame (so we can find its zones)
+};
+
+// A key event as gatherInput saw it
+struct FlightInput {
+	uint64_t stamp; // profilerNow() when it came in
+	int key;
+	int action; // GLFW_PRESS or GLFW_RELEASE
+};
+
+struct FlightRecorder {
+	FlightFrame frames[flightRecorderFrames];
+	unsigned int next;
+	unsigned int count;
+	unsigned int totalFrames;
+	double intervalMs; // What a normal frame takes (vsync interval if vsync is on)
+
+	// A frame's a spike if it takes longer than budgetMs, or if that's 0, longer than
+	// spikeFactor times intervalMs
+	float budgetMs;
+	float spikeFactor;
+
+	FlightInput inputs[flightRecorderInputs];
+	unsigned int nextInput;
+	unsigned int noInputs;
+	double lastDump;
+	unsigned int noDumps;
+
+	// The frame in progress, taken when it starts so it matches the profiler frame its zones get
+	uint64_t frameStart;
+	unsigned int frameIndex;
+
+	// Game thread -> dump thread, one dump at a time (the cooldown keeps them well apart anyway)
+	FlightFrame dumpFrames[flightRecorderFrames]; // Oldest first
+	unsigned int dumpCount;
+	FlightInput dumpInputs[flightRecorderInputs]; // Oldest first
+	unsigned int dumpInputCount;
+	char dumpName[64];
+	atomic<unsigned int> dumpsRequested;
+	atomic<unsigned int> dumpsWritten;
+	atomic<bool> running;
+	thread dumper; // Started the first time there's something to dump
+};
+
+FlightRecorder flightRecorder;
+
+// FNV-1a over the bytes of something
+uint32_t hashBytes(uint32_t hash, const void* data, size_t size) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Hash everything the simulation depends on, two runs that match here match everywhere
+uint32_t hashGameState() {
+	uint32_t hash = 2166136261u;
+	hash = hashBytes(hash, paddleOffsets, sizeof(paddleOffsets));
+	hash = hashBytes(hash, &pongOffset, sizeof(pongOffset));
+	hash = hashBytes(hash, &pongVelocity, sizeof(pongVelocity));
+	hash = hashBytes(hash, &leftScore, sizeof(leftScore));
+	hash = hashBytes(hash, &rightScore, sizeof(rightScore));
+	hash = hashBytes(hash, &pauseMe, sizeof(pauseMe));
+	return hash;
+}
+
+// budget is "<ms>" for a fixed frame budget or "x<factor>" for a multiple of the normal frame interval
+void genFlightRecorder(FlightRecorder& recorder, const char* budget) {
+	recorder.next = 0;
+	recorder.count = 0;
+	recorder.totalFrames = 0;
+	recorder.intervalMs = 0.0;
+	recorder.budgetMs = 0.0f;
+	recorder.spikeFactor = flightRecorderDefaultFactor;
+	bool valid;
+	if (budget[0] == 'x') {
+		recorder.spikeFactor = (float)atof(budget + 1);
+		valid = recorder.spikeFactor > 1.0f;
+	}
+	else {
+		recorder.budgetMs = (float)atof(budget);
+		valid = recorder.budgetMs > 0.0f;
+	}
+	if (!valid) {
+		cout << "Flight recorder budget " << budget << " should be a number of ms or x<factor> over 1, using x" << flightRecorderDefaultFactor << endl;
+		recorder.budgetMs = 0.0f;
+		recorder.spikeFactor = flightRecorderDefaultFactor;
+	}
+	recorder.nextInput = 0;
+	recorder.noInputs = 0;
+	recorder.lastDump = -flightRecorderCooldown;
+	recorder.noDumps = 0;
+	recorder.frameStart = profilerNow();
+	recorder.frameIndex = 0;
+	recorder.dumpCount = 0;
+	recorder.dumpInputCount = 0;
+	recorder.dumpsRequested = 0;
+	recorder.dumpsWritten = 0;
+	recorder.running = false;
+}
+
+// Write frames and key events (oldest first) as Chrome Trace Event JSON, along with the frames' zones
+void flightRecorderDump(const FlightFrame* frames, unsigned int count, const FlightInput* inputs, unsigned int noInputs, const char* filename) {
+	ofstream file(filename);
+	if (!file.is_open()) {
+		cout << "File could not be opened " << filename << endl;
+		return;
+	}
+
+	file << "{\"traceEvents\":[\n";
+	bool first = true;
+
+#if MO_PROFILER
+	profilerWriteZones(file, frames[0].frame, frames[count - 1].frame, first);
+#endif
+
+	// Frames, input changes and state hashes go on their own track
+	const unsigned int tid = 1000;
+	file << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid << ",\"args\":{\"name\":\"flight recorder\"}}";
+
+	unsigned int lastActions = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		const FlightFrame& f = frames[i];
+		char line[256];
+
+		snprintf(line, sizeof(line), ",\n{\"name\":\"frame\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u,\"stateHash\":\"%08x\",\"actions\":%u}}",
+			tid, f.start / 1000.0, f.ms * 1000.0, f.frame, f.stateHash, f.actions);
+		file << line;
+
+		if (f.actions != lastActions) {
+			snprintf(line, sizeof(line), ",\n{\"name\":\"input\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"pressed\":%u,\"released\":%u}}",
+				tid, f.start / 1000.0, f.actions & ~lastActions, lastActions & ~f.actions);
+			file << line;
+			lastActions = f.actions;
+		}
+	}
+
+	for (unsigned int i = 0; i < noInputs; i++) {
+		const FlightInput& in = inputs[i];
+		char line[256];
+		snprintf(line, sizeof(line), ",\n{\"name\":\"key\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"key\":%d,\"action\":\"%s\"}}",
+			tid, in.stamp / 1000.0, in.key, in.action == GLFW_PRESS ? "press" : "release");
+		file << line;
+	}
+
+	file << "\n]}\n";
+}
+
+void flightRecorderThread(FlightRecorder* recorder) {
+	PROFILE_THREAD("Flight Recorder");
+	samplerRegisterThread();
+
+	while (true) {
+		// Check before looking for work so we can't miss the last dump
+		bool stopping = !recorder->running.load(memory_order_acquire);
+		unsigned int written = recorder->dumpsWritten.load(memory_order_relaxed);
+		if (written == recorder->dumpsRequested.load(memory_order_acquire)) {
+			if (stopping) {
+				break;
+			}
+			this_thread::sleep_for(chrono::milliseconds(1));
+			continue;
+		}
+
+		PROFILE_BEGIN("flightDump");
+		flightRecorderDump(recorder->dumpFrames, recorder->dumpCount, recorder->dumpInputs, recorder->dumpInputCount, recorder->dumpName);
+		PROFILE_END();
+		recorder->dumpsWritten.store(written + 1, memory_order_release);
+	}
+}
+
+// Call when a frame starts (after the profiler's moved on to it)
+void flightRecorderBeginFrame(FlightRecorder& recorder, uint64_t start) {
+	recorder.frameStart = start;
+	recorder.frameIndex = recorder.totalFrames;
+#if MO_PROFILER
+	recorder.frameIndex = profilerFrame.load();
+#endif
+}
+
+// Copy what we have for the dump thread to write out, false if it's still busy with the last one
+bool flightRecorderRequestDump(FlightRecorder& recorder, const char* filename) {
+	if (recorder.dumpsWritten.load(memory_order_acquire) != recorder.dumpsRequested.load(memory_order_relaxed)) {
+		return false;
+	}
+
+	unsigned int oldest = (recorder.next + flightRecorderFrames - recorder.count) % flightRecorderFrames;
+	for (unsigned int i = 0; i < recorder.count; i++) {
+		recorder.dumpFrames[i] = recorder.frames[(oldest + i) % flightRecorderFrames];
+	}
+	recorder.dumpCount = recorder.count;
+
+	// Only the key events from the frames we're writing
+	uint64_t since = recorder.count > 0 ? recorder.dumpFrames[0].start : 0;
+	unsigned int oldestInput = (recorder.nextInput + flightRecorderInputs - recorder.noInputs) % flightRecorderInputs;
+	recorder.dumpInputCount = 0;
+	for (unsigned int i = 0; i < recorder.noInputs; i++) {
+		const FlightInput& in = recorder.inputs[(oldestInput + i) % flightRecorderInputs];
+		if (in.stamp >= since) {
+			recorder.dumpInputs[recorder.dumpInputCount++] = in;
+		}
+	}
+	snprintf(recorder.dumpName, sizeof(recorder.dumpName), "%s", filename);
+
+	if (!recorder.running) {
+		recorder.running = true;
+		recorder.dumper = thread(flightRecorderThread, &recorder);
+	}
+	recorder.dumpsRequested.fetch_add(1, memory_order_release);
+	return true;
+}
+
+// Call for every key event the game takes in
+void flightRecorderAddInput(FlightRecorder& recorder, uint64_t stamp, int key, int action) {
+	recorder.inputs[recorder.nextInput] = { stamp, key, action };
+	recorder.nextInput = (recorder.nextInput + 1) % flightRecorderInputs;
+	recorder.noInputs = min(recorder.noInputs + 1, flightRecorderInputs);
+}
+
+// Call once a frame with how long the frame since flightRecorderBeginFrame took, dumps a
+// trace if it was a spike. now is the time in seconds (for the cooldown)
+void flightRecorderAddFrame(FlightRecorder& recorder, float ms, unsigned int actions, uint32_t stateHash, double now) {
+	recorder.frames[recorder.next] = { recorder.frameStart, ms, actions, stateHash, recorder.frameIndex };
+	recorder.next = (recorder.next + 1) % flightRecorderFrames;
+	recorder.count = min(recorder.count + 1, flightRecorderFrames);
+	recorder.totalFrames++;
+
+	// Track the normal frame interval, ignoring the slow frames so a hitch doesn't move the bar
+	if (recorder.intervalMs == 0.0) {
+		recorder.intervalMs = ms;
+	}
+	float budget = recorder.budgetMs > 0.0f ? recorder.budgetMs : (float)recorder.intervalMs * recorder.spikeFactor;
+	bool spike = ms > budget;
+	if (!spike) {
+		recorder.intervalMs = recorder.intervalMs * 0.95 + ms * 0.05;
+	}
+
+	if (spike && recorder.totalFrames > flightRecorderWarmup && now - recorder.lastDump >= flightRecorderCooldown) {
+		char filename[64];
+		snprintf(filename, sizeof(filename), "flight_%u.json", recorder.noDumps);
+		if (flightRecorderRequestDump(recorder, filename)) {
+			cout << "Frame took " << ms << "ms (budget is " << budget << "ms), writing " << filename << "\n";
+			recorder.noDumps++;
+			recorder.lastDump = now;
+		}
+	}
+}
+
+// Finish writing any dump that's still going
+void cleanup(FlightRecorder& recorder) {
+	if (!recorder.running) {
+		return;
+	}
+
+	recorder.running.store(false, memory_order_release);
+	recorder.dumper.join();
+}
+
+//
+// Physics
+//
+
+// The simulation kernels, they only touch what they're given (plus the window size)
+// so the game, the benchmarks and anything else can run them on their own state
+
+// Frames to wait after bouncing off a paddle before it can bounce again
+const unsigned int framesToAllowCollision = 7;
+
+// Move paddles along y
+void movePaddles(vec2d* paddles, float* velocities, unsigned int count, double dt, float speed) {
+	for (unsigned int i = 0; i < count; i++) {
+		paddles[i].y += velocities[i] * dt * speed;
+	}
+}
+
+void moveBall(vec2d& pos, vec2d vel, double dt, float speed) {
+	pos.x += vel.x * dt * speed;
+	pos.y += vel.y * dt * speed;
+}
+
+// Bounce off the top and bottom of the window
+// Returns 1 if it went off the left side (right player scores), 2 if off the right (left player scores), otherwise 0
+unsigned char collideBallWithWindow(vec2d& pos, vec2d& vel) {
+	// Collided with top and bottom of window
+	if (pos.y - pongRadius <= 0 || pos.y + pongRadius >= scrHeight) {
+		vel.y *= -1;
+	}
+
+	// Collided with left and right window
+	if (pos.x - pongRadius <= 0) {
+		return 1;
+	}
+	else if (pos.x + pongRadius >= scrWidth) {
+		return 2;
+	}
+
+	return 0;
+}
+
+// Resets pong's pos and velocity after a point, heading towards whoever got scored on
+void resetBall(vec2d& pos, vec2d& vel, unsigned char pongReset) {
+	pos.x = scrWidth / 2.0f;
+	pos.y = scrHeight / 2.0f;
+
+	vel.x = pongReset == 1 ? pongVelocityInitial.x : -pongVelocityInitial.x;
+	vel.y = pongVelocityInitial.y;
+}
+
+// Bounce the ball off whichever of the two paddles it's closest to
+// framesSinceCollided is -1 until the first hit, and stops the ball getting stuck inside a paddle
+void collideBallWithPaddles(vec2d& pos, vec2d& vel, vec2d* paddles, float* paddleVelocities, unsigned int& framesSinceCollided) {
+	if (framesSinceCollided != -1) {
+		framesSinceCollided++;
+	}
+
+	if (framesSinceCollided < framesToAllowCollision && framesSinceCollided != -1) {
+		return;
+	}
+
+	// Chceck which paddle it is
+	int paddleIndex = 0;
+	if (pos.x > scrHeight / 2.0f) {
+		paddleIndex++;
+	}
+
+	// We are usig the paddle index from above to check which paddle it is likely to collide with
+	// Then over here we are checking the distance of the Pong ball to the paddle
+	vec2d pongToPaddle = { abs(pos.x - paddles[paddleIndex].x), abs(pos.y - paddles[paddleIndex].y) };
+
+	if ((pongToPaddle.x <= halfPaddleWidth + pongRadius) && (pongToPaddle.y <= halfPaddleHeight + pongRadius)) {
+
+		bool collided = false;
+
+		// Collided along the LENGTH of the Paddle
+		if (pongToPaddle.x <= halfPaddleWidth && pongToPaddle.x >= (halfPaddleWidth - pongRadius)) {
+			collided = true;
+			vel.x *= -1; // Flipping the x only
+		}
+
+		// Collided along the WIDTH of the Paddle
+		else if (pongToPaddle.y <= halfPaddleHeight && pongToPaddle.y >= (halfPaddleHeight - pongRadius)) {
+			collided = true;
+			vel.y *= -1; // Flipping the y only
+		}
+
+		// Collided on an edge case (like literally the edge of the paddle is an edge case lol)
+		if ((pongToPaddle.x - halfPaddleWidth) * (pongToPaddle.x - halfPaddleWidth)
+			+ (pongToPaddle.y - halfPaddleHeight) * (pongToPaddle.y - halfPaddleHeight)
+			<= (pongRadius * pongRadius) && (!collided)) {
+			// Pythagorean theorm
+			// Squared distance is < radius^2
+			// therefore distance is less than radius -> We'll treat as length collision since I can't be bothered lol
+
+			collided = true;
+
+			float signedDifference = paddles[paddleIndex].x - pos.x;
+			if (paddleIndex == 0) {
+				// Reversing the difference if right paddle, lefts needs to be +ve
+				signedDifference *= -1;
+			}
+			if ((pongToPaddle.y - halfPaddleHeight) <= (signedDifference - halfPaddleWidth)) {
+				vel.x *= -1; // More of a length collision
+			}
+			else {
+				vel.y *= -1; // Otherwise more of a width collision
+			}
+
+		}
+
+		if (collided) {
+			// Increase velocity of pong ball upong collision
+			float k = 0.5f;
+			vel.x *= 1.1;
+			vel.y += k * 1 * paddleVelocities[paddleIndex];
+
+			framesSinceCollided = 0;
+		}
+	}
+}
+
+//
+// Input Events
+//
+
+// Rather than asking GLFW what's down once a frame (and missing anything shorter than a
+// frame), the key callback pushes timestamped events into a lock-free single producer/single
+// consumer queue, and once a frame gatherInput drains it through the action map (see below)
+// into an InputSnapshot.
+//
+// GLFW only calls us back from inside glfwPollEvents/glfwWaitEvents so the timestamps are
+// when we saw the event, not when it happened, but presses and releases can't get lost any more.
+const unsigned int inputQueueSize = 256; // Power of two
+
+struct InputEvent {
+	double time; // glfwGetTime() when it came in
+	uint64_t stamp; // profilerNow() when it came in, for measuring latency
+	int key;
+	int action; // GLFW_PRESS or GLFW_RELEASE
+};
+
+struct InputQueue {
+	InputEvent events[inputQueueSize];
+	atomic<unsigned int> head; // Next slot to write, only the producer changes it
+	atomic<unsigned int> tail; // Next slot to read, only the consumer changes it
+	atomic<unsigned int> dropped;
+};
+
+InputQueue inputQueue;
+
+// Producer side, returns false (and drops the event) if the queue is full
+bool inputQueuePush(InputQueue& queue, const InputEvent& event) {
+	unsigned int head = queue.head.load(memory_order_relaxed);
+	if (head - queue.tail.load(memory_order_acquire) == inputQueueSize) {
+		queue.dropped.fetch_add(1, memory_order_relaxed);
+		return false;
+	}
+
+	queue.events[head & (inputQueueSize - 1)] = event;
+	queue.head.store(head + 1, memory_order_release);
+	return true;
+}
+
+// Consumer side, returns false if there's nothing to read
+bool inputQueuePop(InputQueue& queue, InputEvent& event) {
+	unsigned int tail = queue.tail.load(memory_order_relaxed);
+	if (tail == queue.head.load(memory_order_acquire)) {
+		return false;
+	}
+
+	event = queue.events[tail & (inputQueueSize - 1)];
+	queue.tail.store(tail + 1, memory_order_release);
+	return true;
+}
+
+void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+	// Key repeat isn't a new press
+	if (action == GLFW_REPEAT) {
+		return;
+	}
+	inputQueuePush(inputQueue, { glfwGetTime(), profilerNow(), key, action });
+}
+
+//
+// Action Map
+//
+
+// Keys don't mean anything to the game by themselves. The action map turns them into
+// actions for a player (up, down, pause, quit), and the simulation only ever sees the
+// resulting InputSnapshot, a few bytes per tick. Replays, benchmarks and anything else
+// that wants to drive the game just make snapshots.
+//
+// Bindings load from bindings.txt if it's there, and F5 walks through rebinding every
+// action while the game's running (then saves them back to bindings.txt).
+enum ActionBit : uint8_t {
+	ACTION_UP = 1 << 0,
+	ACTION_DOWN = 1 << 1,
+	ACTION_PAUSE = 1 << 2,
+	ACTION_QUIT = 1 << 3
+};
+const unsigned int noActions = 4;
+const char* actionNames[noActions] = { "up", "down", "pause", "quit" };
+const unsigned int maxPlayers = 2; // Player 0 is the left paddle, 1 the right
+const unsigned int maxBindings = 32;
+const char* bindingsFile = "bindings.txt";
+
+struct Binding {
+	int key; // GLFW_KEY_*
+	uint8_t player;
+	uint8_t action; // ActionBit
+};
+
+struct ActionMap {
+	Binding bindings[maxBindings];
+	unsigned int noBindings;
+};
+
+ActionMap actionMap;
+
+// One tick of input for every player, all the simulation ever sees
+struct InputSnapshot {
+	uint8_t actions[maxPlayers]; // Down at any point during the tick
+	uint8_t pressed[maxPlayers]; // Went down during the tick
+	uint8_t held[maxPlayers][2]; // How much of the tick up/down were held for, 0 to 255
+};
+
+unsigned int actionIndex(uint8_t action) {
+	return bitLength(action) - 1;
+}
+
+// Every player's actions in one int, 8 bits each
+unsigned int packActions(const InputSnapshot& input) {
+	unsigned int packed = 0;
+	for (unsigned int p = 0; p < maxPlayers; p++) {
+		packed |= (unsigned int)input.actions[p] << (8 * p);
+	}
+	return packed;
+}
+
+// Binds key to a player's action, replacing whatever key that action had and whatever that key did
+void bindAction(ActionMap& map, int key, unsigned int player, uint8_t action) {
+	unsigned int kept = 0;
+	for (unsigned int i = 0; i < map.noBindings; i++) {
+		Binding& b = map.bindings[i];
+		if (b.key == key || (b.player == player && b.action == action)) {
+			continue;
+		}
+		map.bindings[kept++] = b;
+	}
+	map.noBindings = kept;
+
+	if (map.noBindings < maxBindings) {
+		map.bindings[map.noBindings++] = { key, (uint8_t)player, action };
+	}
+}
+
+void bindDefaultActions(ActionMap& map) {
+	map.noBindings = 0;
+	bindAction(map, GLFW_KEY_W, 0, ACTION_UP);
+	bindAction(map, GLFW_KEY_S, 0, ACTION_DOWN);
+	bindAction(map, GLFW_KEY_UP, 1, ACTION_UP);
+	bindAction(map, GLFW_KEY_DOWN, 1, ACTION_DOWN);
+	bindAction(map, GLFW_KEY_P, 0, ACTION_PAUSE);
+	bindAction(map, GLFW_KEY_ESCAPE, 0, ACTION_QUIT);
+}
+
+const Binding* findBinding(ActionMap& map, int key) {
+	for (unsigned int i = 0; i < map.noBindings; i++) {
+		if (map.bindings[i].key == key) {
+			return &map.bindings[i];
+		}
+	}
+	return nullptr;
+}
+
+// One "player action key" per line, e.g. "1 up 265" (key is the GLFW key code)
+bool loadBindings(ActionMap& map, const char* filename) {
+	ifstream file(filename);
+	if (!file.is_open()) {
+		return false;
+	}
+
+	unsigned int player;
+	string name;
+	int key;
+	while (file >> player >> name >> key) {
+		for (unsigned int a = 0; a < noActions; a++) {
+			if (name == actionNames[a] && player < maxPlayers) {
+				bindAction(map, key, player, (uint8_t)(1 << a));
+			}
+		}
+	}
+	return true;
+}
+
+void saveBindings(ActionMap& map, const char* filename) {
+	ofstream file(filename);
+	if (!file.is_open()) {
+		cout << "File could not be opened " << filename << endl;
+		return;
+	}
+
+	for (unsigned int i = 0; i < map.noBindings; i++) {
+		Binding& b = map.bindings[i];
+		file << (unsigned int)b.player << " " << actionNames[actionIndex(b.action)] << " " << b.key << "\n";
+	}
+}
+
+// F5 rebinding, the next key pressed gets bound to each of these in turn
+struct RebindStep {
+	unsigned int player;
+	uint8_t action;
+};
+
+const RebindStep rebindSteps[] = {
+	{ 0, ACTION_UP }, { 0, ACTION_DOWN }, { 1, ACTION_UP }, { 1, ACTION_DOWN }, { 0, ACTION_PAUSE }, { 0, ACTION_QUIT }
+};
+const unsigned int noRebindSteps = sizeof(rebindSteps) / sizeof(RebindStep);
+unsigned int rebindStep = noRebindSteps; // noRebindSteps when we're not rebinding
+
+void promptRebind() {
+	if (rebindStep < noRebindSteps) {
+		cout << "Press a key for player " << rebindSteps[rebindStep].player + 1 << " "
+			<< actionNames[actionIndex(rebindSteps[rebindStep].action)] << " (escape to stop)" << endl;
+	}
+	else {
+		saveBindings(actionMap, bindingsFile);
+		cout << "Saved bindings to " << bindingsFile << endl;
+	}
+}
+
+// How many bound keys are holding each action down, and since when
+unsigned char actionKeysDown[maxPlayers][noActions];
+double actionDownSince[maxPlayers][noActions];
+
+// Stamp of the earliest press [0] and release [1] of each action since the last frame went
+// to the GPU, picked up by the latency tracker (see Input Latency)
+uint64_t pendingInputStamps[noActions][2];
+
+// Drain the queue into the snapshot for the tick running from frameStart to frameEnd
+// Debug keys (F3, F5, F9, F11, F12) and quitting get handled straight away
+InputSnapshot gatherInput(GLFWwindow* window, double frameStart, double frameEnd) {
+	InputSnapshot input = {};
+	double heldTime[maxPlayers][noActions] = {};
+
+	// Anything still down carries over from last tick
+	for (unsigned int p = 0; p < maxPlayers; p++) {
+		for (unsigned int a = 0; a < noActions; a++) {
+			if (actionKeysDown[p][a]) {
+				actionDownSince[p][a] = frameStart;
+				input.actions[p] |= 1 << a;
+			}
+		}
+	}
+
+	InputEvent event;
+	while (inputQueuePop(inputQueue, event)) {
+		double t = min(max(event.time, frameStart), frameEnd);
+		redrawRequested = true;
+		flightRecorderAddInput(flightRecorder, event.stamp, event.key, event.action);
+
+		if (event.action == GLFW_PRESS) {
+			switch (event.key) {
+			case GLFW_KEY_F12: dumpCommandsRequested = true; continue;
+			case GLFW_KEY_F11: dumpTraceRequested = true; continue;
+			case GLFW_KEY_F9: histogramPrintRequested = true; continue;
+			case GLFW_KEY_F3: perfOverlay.visible = !perfOverlay.visible; continue;
+			case GLFW_KEY_F5:
+				// Let go of everything, the keys holding actions down might be about to change
+				memset(actionKeysDown, 0, sizeof(actionKeysDown));
+				rebindStep = 0;
+				promptRebind();
+				continue;
+			}
+
+			if (rebindStep < noRebindSteps) {
+				if (event.key == GLFW_KEY_ESCAPE) {
+					rebindStep = noRebindSteps;
+				}
+				else {
+					bindAction(actionMap, event.key, rebindSteps[rebindStep].player, rebindSteps[rebindStep].action);
+					rebindStep++;
+				}
+				promptRebind();
+				continue;
+			}
+		}
+
+		const Binding* binding = findBinding(actionMap, event.key);
+		if (!binding) {
+			continue;
+		}
+		unsigned int p = binding->player;
+		unsigned int a = actionIndex(binding->action);
+
+		if (event.action == GLFW_PRESS) {
+			if (actionKeysDown[p][a]++ == 0) {
+				actionDownSince[p][a] = t;
+				input.actions[p] |= binding->action;
+				input.pressed[p] |= binding->action;
+				if (!pendingInputStamps[a][0]) {
+					pendingInputStamps[a][0] = event.stamp;
+				}
+			}
+		}
+		else if (event.action == GLFW_RELEASE && actionKeysDown[p][a] > 0) {
+			if (--actionKeysDown[p][a] == 0) {
+				heldTime[p][a] += t - actionDownSince[p][a];
+				if (!pendingInputStamps[a][1]) {
+					pendingInputStamps[a][1] = event.stamp;
+				}
+			}
+		}
+	}
+
+	double length = frameEnd - frameStart;
+	for (unsigned int p = 0; p < maxPlayers; p++) {
+		for (unsigned int a = 0; a < 2; a++) {
+			if (actionKeysDown[p][a]) {
+				heldTime[p][a] += frameEnd - actionDownSince[p][a];
+			}
+			double fraction = length > 0.0 ? min(heldTime[p][a] / length, 1.0) : (actionKeysDown[p][a] ? 1.0 : 0.0);
+			input.held[p][a] = (uint8_t)(fraction * 255.0 + 0.5);
+		}
+
+		if (input.pressed[p] & ACTION_QUIT) {
+			glfwSetWindowShouldClose(window, true);
+		}
+	}
+
+	return input;
+}
+
+//
+// Input Latency
+//
+
+// Every key event is stamped when it comes in. Once a frame has been swapped we drop a
+// fence and a timestamp query in after it, and when the fence has signalled (checked
+// without waiting, a few frames later) the query says when the GPU got through the frame,
+// present included. Latency for each action's presses and releases goes into its own
+// histogram, along with submit to swap-complete for every frame.
+//
+// This stops at the GPU finishing the frame, scanout adds up to another refresh on top.
+const unsigned int latencyFrames = 4;
+
+struct LatencyFrame {
+	GLsync fence;
+	GLuint query;
+	uint64_t submit; // profilerNow() after the frame's commands went to the driver
+	uint64_t inputStamps[noActions][2];
+	bool pending;
+};
+
+struct LatencyTracker {
+	LatencyFrame frames[latencyFrames];
+	unsigned int next;
+	unsigned int dropped; // Frames we gave up on because the fence hadn't signalled by the time we needed the slot
+	HdrHistogram inputToPhoton[noActions][2];
+	HdrHistogram submitToPhoton;
+};
+
+LatencyTracker latencyTracker;
+
+const char* latencyHistogramNames[noActions][2] = {
+	{ "up_press_us", "up_release_us" },
+	{ "down_press_us", "down_release_us" },
+	{ "pause_press_us", "pause_release_us" },
+	{ "quit_press_us", "quit_release_us" }
+};
+
+void genLatencyTracker(LatencyTracker& tracker) {
+	for (unsigned int i = 0; i < latencyFrames; i++) {
+		glGenQueries(1, &tracker.frames[i].query);
+		tracker.frames[i].fence = 0;
+		tracker.frames[i].pending = false;
+	}
+	tracker.next = 0;
+	tracker.dropped = 0;
+
+	for (unsigned int a = 0; a < noActions; a++) {
+		for (unsigned int e = 0; e < 2; e++) {
+			genHistogram(tracker.inputToPhoton[a][e], latencyHistogramNames[a][e]);
+		}
+	}
+	genHistogram(tracker.submitToPhoton, "submit_to_photon_us");
+}
+
+// Record a frame's latencies if the GPU is done with it, returns false (without waiting) if it isn't
+bool latencyResolve(LatencyTracker& tracker, LatencyFrame& f) {
+	GLenum status = glClientWaitSync(f.fence, 0, 0);
+	if (status == GL_TIMEOUT_EXPIRED) {
+		return false;
+	}
+
+	// The fence is broken (lost context or the like), so we'd block reading the query, drop the sample
+	if (status == GL_WAIT_FAILED) {
+		glDeleteSync(f.fence);
+		f.fence = 0;
+		f.pending = false;
+		tracker.dropped++;
+		return true;
+	}
+
+	GLuint64 gpuDone;
+	glGetQueryObjectui64v(f.query, GL_QUERY_RESULT, &gpuDone);
+	uint64_t photon = gpuDone + gpuTimer.gpuToCpuOffset;
+
+	if (photon > f.submit) {
+		histogramRecord(tracker.submitToPhoton, (photon - f.submit) / 1000);
+	}
+	for (unsigned int a = 0; a < noActions; a++) {
+		for (unsigned int e = 0; e < 2; e++) {
+			if (f.inputStamps[a][e] && photon > f.inputStamps[a][e]) {
+				histogramRecord(tracker.inputToPhoton[a][e], (photon - f.inputStamps[a][e]) / 1000);
+			}
+		}
+	}
+
+	glDeleteSync(f.fence);
+	f.fence = 0;
+	f.pending = false;
+	return true;
+}
+
+// Call right after swapping, submit is when the frame's commands were handed over
+void latencyEndFrame(LatencyTracker& tracker, uint64_t submit) {
+	// Pick up anything that's finished
+	for (unsigned int i = 0; i < latencyFrames; i++) {
+		if (tracker.frames[i].pending) {
+			latencyResolve(tracker, tracker.frames[i]);
+		}
+	}
+
+	LatencyFrame& f = tracker.frames[tracker.next];
+	if (f.pending) {
+		glDeleteSync(f.fence);
+		tracker.dropped++;
+	}
+
+	glQueryCounter(f.query, GL_TIMESTAMP);
+	f.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	f.submit = submit;
+	memcpy(f.inputStamps, pendingInputStamps, sizeof(pendingInputStamps));
+	memset(pendingInputStamps, 0, sizeof(pendingInputStamps));
+	f.pending = true;
+
+	tracker.next = (tracker.next + 1) % latencyFrames;
+}
+
+void printLatencyHistograms(LatencyTracker& tracker) {
+	printHistogram(tracker.submitToPhoton);
+	for (unsigned int a = 0; a < noActions; a++) {
+		for (unsigned int e = 0; e < 2; e++) {
+			if (tracker.inputToPhoton[a][e].totalCount) {
+				printHistogram(tracker.inputToPhoton[a][e]);
+			}
+		}
+	}
+}
+
+void cleanupLatencyTracker(LatencyTracker& tracker) {
+	for (unsigned int i = 0; i < latencyFrames; i++) {
+		if (tracker.frames[i].fence) {
+			glDeleteSync(tracker.frames[i].fence);
+		}
+		glDeleteQueries(1, &tracker.frames[i].query);
+	}
+}
+
+//
+// Late Latch
+//
+
+// The paddles the player sees were moved by input from the start of the frame, and the
+// frame then spends a while in physics/recording before they're drawn. With --late-latch
+// we poll again right before submitting the paddles and draw them where they'd be by now.
+// This only changes where they're drawn: the new events stay in the queue for the next
+// tick's gatherInput, so the simulation (and replays) see exactly what they would have anyway.
+// A resize that comes in with them waits for the next frame (see framebufferSizeCallback).
+bool lateLatchEnabled = false;
+
+// How far (in y) each player's paddle has moved between tickEnd and now, going by the
+// events that have come in since then
+void lateLatchPaddles(double tickEnd, double now, float* offsets) {
+	glfwPollEvents();
+
+	// Same bookkeeping as gatherInput, on a copy, and only for up/down
+	unsigned char keysDown[maxPlayers][2];
+	double downSince[maxPlayers][2];
+	double heldTime[maxPlayers][2] = {};
+	for (unsigned int p = 0; p < maxPlayers; p++) {
+		for (unsigned int a = 0; a < 2; a++) {
+			keysDown[p][a] = actionKeysDown[p][a];
+			downSince[p][a] = tickEnd;
+		}
+	}
+
+	// Peek, only the consumer moves the tail so the events can't go anywhere while we look
+	unsigned int tail = inputQueue.tail.load(memory_order_relaxed);
+	unsigned int head = inputQueue.head.load(memory_order_acquire);
+	for (unsigned int i = tail; i != head; i++) {
+		InputEvent& event = inputQueue.events[i & (inputQueueSize - 1)];
+		const Binding* binding = findBinding(actionMap, event.key);
+		if (!binding || rebindStep < noRebindSteps) {
+			continue;
+		}
+
+		unsigned int p = binding->player;
+		unsigned int a = actionIndex(binding->action);
+		if (a >= 2) {
+			continue;
+		}
+
+		double t = min(max(event.time, tickEnd), now);
+		if (event.action == GLFW_PRESS) {
+			if (keysDown[p][a]++ == 0) {
+				downSince[p][a] = t;
+			}
+		}
+		else if (event.action == GLFW_RELEASE && keysDown[p][a] > 0) {
+			if (--keysDown[p][a] == 0) {
+				heldTime[p][a] += t - downSince[p][a];
+			}
+		}
+	}
+
+	for (unsigned int p = 0; p < maxPlayers; p++) {
+		for (unsigned int a = 0; a < 2; a++) {
+			if (keysDown[p][a]) {
+				heldTime[p][a] += now - downSince[p][a];
+			}
+		}
+		offsets[p] = (float)(paddleSpeed * gameSpeed * (heldTime[p][0] - heldTime[p][1]));
+	}
+}
+
+//
+// Idle
+//
+
+// Paused, minimized or just sitting there, there's no point clearing, uploading and drawing
+// the same frame over and over. When the window is minimized (or the framebuffer is 0 sized)
+// or nothing that ends up on screen has changed since the last frame we drew, we skip drawing
+// and block in glfwWaitEventsTimeout until something happens. Input, resizes and the window
+// needing a repaint all wake us up and ask for a redraw. --no-idle turns this off.
+const double idleTimeout = 0.5; // Longest we sleep when nothing's happening, seconds
+const double idleSimulationStep = 1.0 / 60.0; // How often to wake up to keep simulating while minimized
+
+bool idleEnabled = true;
+
+void windowRefreshCallback(GLFWwindow* window) {
+	redrawRequested = true;
+}
+
+bool windowMinimized(GLFWwindow* window) {
+	int width, height;
+	glfwGetFramebufferSize(window, &width, &height);
+	return width == 0 || height == 0 || glfwGetWindowAttrib(window, GLFW_ICONIFIED);
+}
+
+// Whether this frame needs drawing, sceneHash is what's on screen now and lastDrawn what we last drew
+bool frameNeedsDrawing(GLFWwindow* window, uint32_t sceneHash, uint32_t lastDrawn) {
+	if (!idleEnabled) {
+		return true;
+	}
+	if (windowMinimized(window)) {
+		return false;
+	}
+
+	// The overlay's graph changes every frame
+	return redrawRequested || sceneHash != lastDrawn || perfOverlay.visible;
+}
+
+// Sleep until something happens, or it's time for the simulation to move on
+void idleWait() {
+	glfwWaitEventsTimeout(pauseMe ? idleTimeout : idleSimulationStep);
+}
+
+//
+// Frame Pacing
+//
+
+// Left alone, pacing is whatever the driver feels like: vsync off means spinning flat out
+// drawing thousands of identical frames, vsync on can let the driver queue up several frames
+// of latency. So we pick the swap interval ourselves (adaptive vsync when the driver has
+// swap_control_tear, so a late frame tears instead of waiting a whole refresh), optionally
+// hold the loop to a target rate, and never let more than maxQueuedFrames sit in the driver.
+//
+// The limiter sleeps for most of the wait and spins the rest. We keep track of how late
+// sleeps wake up and stop sleeping that much early, so it lands within a fraction of a
+// millisecond without burning a core. Windows rounds sleeps up to its timer tick (15.6ms
+// by default), so while the limiter's on we ask for 1ms ticks.
+enum VsyncMode {
+	VSYNC_OFF,
+	VSYNC_ON,
+	VSYNC_ADAPTIVE
+};
+
+const unsigned int maxQueuedFramesLimit = 8;
+const unsigned int pacerFenceSlots = maxQueuedFramesLimit + 1; // The new frame's fence goes in before we drop back to the limit
+const uint64_t pacerSpinMargin = 200000; // ns we always spin for at the end, on top of the sleep overshoot
+
+struct FramePacer {
+	VsyncMode vsync;
+	uint64_t targetNs; // 0 when there's no limiter
+	uint64_t nextFrame; // profilerNow() the next frame should start at
+	double sleepOvershoot; // ns, running average of how late sleeps wake up
+	uint64_t sleptNs; // Totals so we can tell how much CPU the limiter costs
+	uint64_t spunNs;
+
+	unsigned int maxQueuedFrames; // 0 to let the driver queue as many as it wants
+	GLsync fences[pacerFenceSlots];
+	unsigned int noFences;
+	unsigned int oldestFence;
+};
+
+FramePacer framePacer;
+
+// Call once the context is current
+// fps of 0 means no limiter, unless vsync is off, then we limit to the monitor's refresh rate
+// Negative fps means no limiter at all
+void genFramePacer(FramePacer& pacer, VsyncMode vsync, double fps, unsigned int maxQueuedFrames) {
+	if (vsync == VSYNC_ADAPTIVE && !glfwExtensionSupported("WGL_EXT_swap_control_tear") && !glfwExtensionSupported("GLX_EXT_swap_control_tear")) {
+		vsync = VSYNC_ON;
+	}
+	pacer.vsync = vsync;
+	glfwSwapInterval(vsync == VSYNC_OFF ? 0 : vsync == VSYNC_ON ? 1 : -1);
+
+	if (fps == 0.0 && vsync == VSYNC_OFF) {
+		GLFWmonitor* monitor = glfwGetPrimaryMonitor();
+		const GLFWvidmode* mode = monitor ? glfwGetVideoMode(monitor) : nullptr;
+		fps = mode && mode->refreshRate > 0 ? mode->refreshRate : 60.0;
+	}
+	pacer.targetNs = fps > 0.0 ? (uint64_t)(1e9 / fps) : 0;
+#ifdef _WIN32
+	if (pacer.targetNs) {
+		timeBeginPeriod(1);
+	}
+#endif
+	pacer.nextFrame = 0;
+	pacer.sleepOvershoot = 1000000.0; // Start off assuming sleeps are a millisecond late
+	pacer.sleptNs = 0;
+	pacer.spunNs = 0;
+
+	pacer.maxQueuedFrames = min(maxQueuedFrames, maxQueuedFramesLimit);
+	pacer.noFences = 0;
+	pacer.oldestFence = 0;
+
+	const char* vsyncNames[] = { "off", "on", "adaptive" };
+	cout << "Vsync " << vsyncNames[vsync];
+	if (pacer.targetNs) {
+		cout << ", limiting to " << fps << " fps";
+	}
+	cout << endl;
+}
+
+// Don't let the CPU get more than maxQueuedFrames ahead of the GPU, call right after swapping
+void pacerThrottleQueue(FramePacer& pacer) {
+	if (pacer.maxQueuedFrames == 0) {
+		return;
+	}
+
+	pacer.fences[(pacer.oldestFence + pacer.noFences) % pacerFenceSlots] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	pacer.noFences++;
+
+	while (pacer.noFences > pacer.maxQueuedFrames) {
+		GLsync fence = pacer.fences[pacer.oldestFence];
+		glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000); // Give up after 100ms, something's wrong
+		glDeleteSync(fence);
+		pacer.oldestFence = (pacer.oldestFence + 1) % pacerFenceSlots;
+		pacer.noFences--;
+	}
+}
+
+// Wait until it's time for the next frame
+void pacerLimit(FramePacer& pacer) {
+	if (pacer.targetNs == 0) {
+		return;
+	}
+
+	uint64_t now = profilerNow();
+	if (pacer.nextFrame == 0) {
+		pacer.nextFrame = now;
+	}
+	pacer.nextFrame += pacer.targetNs;
+
+	// Fell behind, start again from now rather than rushing to catch up
+	if (pacer.nextFrame < now) {
+		pacer.nextFrame = now;
+		return;
+	}
+
+	// Sleep for the bulk of it
+	uint64_t sleepUntil = pacer.nextFrame - min(pacer.nextFrame - now, (uint64_t)pacer.sleepOvershoot + pacerSpinMargin);
+	if (sleepUntil > now) {
+		this_thread::sleep_for(chrono::nanoseconds(sleepUntil - now));
+		uint64_t woke = profilerNow();
+		double overshoot = woke > sleepUntil ? (double)(woke - sleepUntil) : 0.0;
+		// Quick to go up, slow to come back down, so one late wake up makes us more careful for a while
+		pacer.sleepOvershoot += (overshoot - pacer.sleepOvershoot) * (overshoot > pacer.sleepOvershoot ? 0.5 : 0.02);
+		pacer.sleptNs += woke - now;
+		now = woke;
+	}
+
+	// Spin the rest
+	while (now < pacer.nextFrame) {
+		this_thread::yield();
+		uint64_t later = profilerNow();
+		pacer.spunNs += later - now;
+		now = later;
+	}
+}
+
+void cleanupFramePacer(FramePacer& pacer) {
+	for (unsigned int i = 0; i < pacer.noFences; i++) {
+		glDeleteSync(pacer.fences[(pacer.oldestFence + i) % pacerFenceSlots]);
+	}
+	pacer.noFences = 0;
+
+	if (pacer.targetNs) {
+#ifdef _WIN32
+		timeEndPeriod(1);
+#endif
+		char line[128];
+		snprintf(line, sizeof(line), "Frame limiter slept %.1f s and spun %.1f s", pacer.sleptNs / 1e9, pacer.spunNs / 1e9);
+		cout << line << endl;
+	}
+}
+
+//
+// Headless
+//
+
+// --headless [osmesa|egl] runs the real renderer with no display at all, on GLFW's null platform
+// with a software (OSMesa/llvmpipe) or surfaceless EGL context, so the build machines without a
+// GPU still draw every frame. A surfaceless context has no window framebuffer, and a hidden
+// window's might not get drawn to at all, so in both cases we draw into an offscreen target.
+// screenFramebuffer is whatever the rest of the renderer treats as the window.
+//
+// On top of that, --golden <dir> compares chosen frames of a replay against TGAs in dir
+// (--write-golden <dir> saves them instead), --golden-frames picks which ones. Replays step
+// by a fixed amount so the same frame should come out the same every time, give or take some
+// rounding between rasterizer versions.
+const unsigned int maxGoldenFrames = 32;
+const unsigned int goldenChannelTolerance = 2; // Per channel, rasterizers round a little differently
+const double goldenMaxBadPixels = 0.001; // Fraction of the pixels allowed past the tolerance
+
+GLuint screenFramebuffer = 0; // 0 is the real window
+GLuint screenColorBuffer = 0;
+
+void resizeOffscreenScreen(unsigned int width, unsigned int height) {
+	if (!screenFramebuffer) {
+		return;
+	}
+	glBindRenderbuffer(GL_RENDERBUFFER, screenColorBuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+}
+
+void cleanupOffscreenScreen() {
+	if (!screenFramebuffer) {
+		return;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &screenFramebuffer);
+	glDeleteRenderbuffers(1, &screenColorBuffer);
+	screenFramebuffer = 0;
+	screenColorBuffer = 0;
+}
+
+// Call once the context is current, it stays bound from then on
+// Returns false if the driver won't make one, then we're stuck with the window's
+bool genOffscreenScreen(unsigned int width, unsigned int height) {
+	glGenFramebuffers(1, &screenFramebuffer);
+	glGenRenderbuffers(1, &screenColorBuffer);
+	resizeOffscreenScreen(width, height);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, screenFramebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, screenColorBuffer);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		cout << "Offscreen framebuffer is incomplete, drawing to the window" << endl;
+		cleanupOffscreenScreen();
+		return false;
+	}
+	return true;
+}
+
+// Read back what's on "the screen", this waits for the GPU to finish so it's only for tests
+void readScreen(Image& image, unsigned int width, unsigned int height) {
+	image.width = width;
+	image.height = height;
+	image.pixels = new unsigned char[width * height * 4];
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, image.pixels);
+}
+
+struct GoldenImages {
+	const char* dir; // nullptr when we're not checking
+	bool write; // Save new goldens instead of comparing
+	unsigned int frames[maxGoldenFrames];
+	unsigned int noFrames;
+	unsigned int checked;
+	unsigned int failed;
+};
+
+GoldenImages goldenImages;
+
+// frameList is comma separated replay frame numbers
+void genGoldenImages(GoldenImages& golden, const char* dir, bool write, const char* frameList) {
+	golden.dir = dir;
+	golden.write = write;
+	golden.noFrames = 0;
+	golden.checked = 0;
+	golden.failed = 0;
+
+	const char* at = frameList;
+	while (*at && golden.noFrames < maxGoldenFrames) {
+		char* end;
+		unsigned long frame = strtoul(at, &end, 10);
+		if (end == at) {
+			break;
+		}
+		golden.frames[golden.noFrames++] = (unsigned int)frame;
+		at = *end == ',' ? end + 1 : end;
+	}
+}
+
+// Max difference over R, G and B, alpha depends on how the target was cleared so we leave it out
+unsigned int pixelDifference(const unsigned char* a, const unsigned char* b) {
+	unsigned int diff = 0;
+	for (unsigned int c = 0; c < 3; c++) {
+		diff = max(diff, (unsigned int)abs(a[c] - b[c]));
+	}
+	return diff;
+}
+
+// Check (or save) the frame that's just been drawn, if it's one we want
+void goldenCheckFrame(GoldenImages& golden, unsigned int frame) {
+	if (!golden.dir) {
+		return;
+	}
+
+	bool wanted = false;
+	for (unsigned int i = 0; i < golden.noFrames; i++) {
+		wanted = wanted || golden.frames[i] == frame;
+	}
+	if (!wanted) {
+		return;
+	}
+	golden.checked++;
+
+	char path[512];
+	snprintf(path, sizeof(path), "%s/frame_%05u.tga", golden.dir, frame);
+	Image actual;
+	readScreen(actual, scrWidth, scrHeight);
+
+	if (golden.write) {
+		if (saveImage(path, actual)) {
+			cout << "Wrote " << path << endl;
+		}
+		cleanup(actual);
+		return;
+	}
+
+	bool passed = false;
+	Image expected;
+	if (loadImage(path, expected)) {
+		if (expected.width != actual.width || expected.height != actual.height) {
+			cout << "Frame " << frame << " is " << actual.width << "x" << actual.height << " but the golden is "
+				<< expected.width << "x" << expected.height << endl;
+		}
+		else {
+			unsigned int noPixels = actual.width * actual.height;
+			unsigned int badPixels = 0;
+			unsigned int maxDiff = 0;
+			for (unsigned int i = 0; i < noPixels; i++) {
+				unsigned int diff = pixelDifference(actual.pixels + i * 4, expected.pixels + i * 4);
+				maxDiff = max(maxDiff, diff);
+				badPixels += diff > goldenChannelTolerance;
+			}
+			passed = badPixels <= goldenMaxBadPixels * noPixels;
+			cout << "Frame " << frame << (passed ? " matches" : " DIFFERS from") << " its golden, "
+				<< badPixels << " pixels off, max difference " << maxDiff << endl;
+		}
+		cleanup(expected);
+	}
+
+	// Keep what we got so someone can look at it (or promote it to the new golden)
+	if (!passed) {
+		golden.failed++;
+		snprintf(path, sizeof(path), "%s/frame_%05u_actual.tga", golden.dir, frame);
+		if (saveImage(path, actual)) {
+			cout << "Wrote " << path << endl;
+		}
+	}
+	cleanup(actual);
+}
+
+// Returns the exe's exit code, a frame the replay never got to counts as a failure
+int finishGoldenImages(GoldenImages& golden) {
+	if (!golden.dir) {
+		return 0;
+	}
+
+	unsigned int missed = golden.noFrames > golden.checked ? golden.noFrames - golden.checked : 0;
+	if (golden.write) {
+		cout << "Wrote " << golden.checked << " golden images to " << golden.dir << endl;
+	}
+	else {
+		cout << "Golden images: " << golden.checked << " checked, " << golden.failed << " failed" << endl;
+	}
+	if (missed) {
+		cout << missed << " golden frames are past the end of the replay" << endl;
+	}
+	return golden.failed || missed ? 1 : 0;
+}
+
+//
+// Dynamic Resolution
+//
+
+// When the GPU can't keep up (fill rate on a low end card, lots of sprites) we draw the scene
+// into an offscreen target at a fraction of the window's size and stretch it back up. The scale
+// follows the GPU frame time from the GPU timer: it drops as soon as a few frames in a row go
+// over budget, and only comes back up once we're confident the next step up still fits, so it
+// doesn't bounce between two sizes. The HUD is drawn after the upscale so text stays sharp.
+// --dynamic-resolution [ms] turns it on, the budget defaults to 80% of a refresh.
+const float dynResMinScale = 0.5f;
+const float dynResStep = 0.05f;
+const unsigned int dynResDropFrames = 4; // Over budget this many resolved frames in a row to drop
+const unsigned int dynResRaiseFrames = 30; // Fits this many in a row to raise
+const double dynResRaiseHeadroom = 0.85; // The next step up has to fit in this much of the budget
+
+struct DynamicResolution {
+	bool enabled;
+	GLuint fbo;
+	GLuint colorTexture;
+	unsigned int width, height; // Full size, the same as the window's framebuffer
+
+	float scale; // Of each side, dynResMinScale to 1
+	double budgetMs;
+	unsigned int overBudget; // Resolved frames in a row over/under the budget
+	unsigned int underBudget;
+	unsigned int cooldown; // Results still on their way from before the last change
+	unsigned int lastResolved; // gpuTimer.resolvedFrames we last looked at
+};
+
+DynamicResolution dynamicResolution;
+
+// The color target is always allocated full size, we just draw into the corner of it,
+// so changing the scale never reallocates anything
+void resizeDynamicResolution(DynamicResolution& dr, unsigned int width, unsigned int height) {
+	if (!dr.enabled || (width == dr.width && height == dr.height)) {
+		return;
+	}
+	dr.width = width;
+	dr.height = height;
+
+	glBindTexture(GL_TEXTURE_2D, dr.colorTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Call once the context is current, budgetMs of 0 picks 80% of the monitor's refresh
+void genDynamicResolution(DynamicResolution& dr, unsigned int width, unsigned int height, double budgetMs) {
+	if (budgetMs <= 0.0) {
+		GLFWmonitor* monitor = glfwGetPrimaryMonitor();
+		const GLFWvidmode* mode = monitor ? glfwGetVideoMode(monitor) : nullptr;
+		budgetMs = 0.8 * 1000.0 / (mode && mode->refreshRate > 0 ? mode->refreshRate : 60.0);
+	}
+
+	dr.enabled = true;
+	dr.width = 0;
+	dr.height = 0;
+	dr.scale = 1.0f;
+	dr.budgetMs = budgetMs;
+	dr.overBudget = 0;
+	dr.underBudget = 0;
+	dr.cooldown = 0;
+	dr.lastResolved = gpuTimer.resolvedFrames;
+
+	glGenTextures(1, &dr.colorTexture);
+	glBindTexture(GL_TEXTURE_2D, dr.colorTexture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	resizeDynamicResolution(dr, width, height);
+
+	glGenFramebuffers(1, &dr.fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, dr.fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, dr.colorTexture, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		cout << "Dynamic resolution framebuffer is incomplete, drawing at full resolution" << endl;
+		dr.enabled = false;
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, screenFramebuffer);
+
+	cout << "Dynamic resolution, GPU budget " << budgetMs << " ms" << endl;
+}
+
+// Look at the latest GPU frame time and move the scale if we need to, once per frame
+void updateDynamicResolution(DynamicResolution& dr) {
+	if (!dr.enabled || gpuTimer.resolvedFrames == dr.lastResolved) {
+		return;
+	}
+	dr.lastResolved = gpuTimer.resolvedFrames;
+
+	// Frames still in flight when we changed were drawn at the old size
+	if (dr.cooldown) {
+		dr.cooldown--;
+		return;
+	}
+
+	double gpuMs = gpuTimer.frameMs;
+	float newScale = dr.scale;
+
+	if (gpuMs > dr.budgetMs) {
+		dr.underBudget = 0;
+		if (++dr.overBudget >= dynResDropFrames && dr.scale > dynResMinScale) {
+			// Cost goes with the pixel count, so jump straight to about where it should fit
+			float fits = dr.scale * (float)sqrt(dr.budgetMs / gpuMs);
+			newScale = max(min(fits, dr.scale - dynResStep), dynResMinScale);
+		}
+	}
+	else {
+		dr.overBudget = 0;
+		float next = min(dr.scale + dynResStep, 1.0f);
+		double nextMs = gpuMs * (next * next) / (dr.scale * dr.scale);
+		if (nextMs < dr.budgetMs * dynResRaiseHeadroom) {
+			if (++dr.underBudget >= dynResRaiseFrames && dr.scale < 1.0f) {
+				newScale = next;
+			}
+		}
+		else {
+			dr.underBudget = 0;
+		}
+	}
+
+	if (newScale != dr.scale) {
+		// Snap to whole steps so we only ever use a handful of sizes
+		newScale = min(max(dynResStep * roundf(newScale / dynResStep), dynResMinScale), 1.0f);
+		cout << "Render scale " << newScale << " (GPU " << gpuMs << " ms, budget " << dr.budgetMs << " ms)" << endl;
+		dr.scale = newScale;
+		dr.overBudget = 0;
+		dr.underBudget = 0;
+		dr.cooldown = gpuTimerFrames;
+	}
+}
+
+// Whether the scene should go through the offscreen target this frame
+bool dynamicResolutionActive(DynamicResolution& dr) {
+	return dr.enabled && dr.scale < 1.0f;
+}
+
+// Size of the part of the target the scene gets drawn into
+unsigned int renderWidth(DynamicResolution& dr) {
+	return max(1u, (unsigned int)(dr.width * dr.scale + 0.5f));
+}
+
+unsigned int renderHeight(DynamicResolution& dr) {
+	return max(1u, (unsigned int)(dr.height * dr.scale + 0.5f));
+}
+
+void cleanup(DynamicResolution& dr) {
+	if (dr.fbo) {
+		glDeleteFramebuffers(1, &dr.fbo);
+		glDeleteTextures(1, &dr.colorTexture);
+	}
+	dr.enabled = false;
+	dr.fbo = 0;
+}
+
+//
+// Frame Capture
+//
+
+// --capture <file> records every frame we draw without the game thread waiting on the GPU.
+// glReadPixels goes into a ring of pixel buffer objects, so it returns straight away and the
+// copy happens whenever the GPU gets to it. A few frames later, once that frame's fence has
+// gone by, we map the buffer, copy the pixels into a free slot and hand it to a writer thread,
+// which does the color conversion and the disk IO. If the writer falls behind the frame gets
+// dropped rather than stalling us, except in replays, where nobody's playing and every frame
+// should make it into the video. A .y4m file gets a YUV 4:2:0 video (ffmpeg and mpv read it
+// as is), any other name gets a numbered TGA per frame.
+const unsigned int capturePBOs = 4; // Frames we can have in flight on the GPU
+const unsigned int captureQueueSize = 8; // Frames we can have waiting on the writer, power of 2
+
+struct CaptureReadback {
+	GLuint pbo;
+	GLsync fence;
+	unsigned int frame;
+};
+
+struct FrameCapture {
+	bool active;
+	const char* filename;
+	bool y4m;
+	unsigned int width, height; // Size when we started, a Y4M can't change size part way through
+	unsigned int fps;
+	bool lossless; // Wait for the writer instead of dropping frames
+
+	CaptureReadback readbacks[capturePBOs];
+	unsigned int oldestReadback;
+	unsigned int noReadbacks;
+	unsigned int frame; // Frames read back so far
+
+	// Game thread -> writer thread, single producer/consumer like the input queue
+	unsigned char* pixels[captureQueueSize];
+	unsigned int frameNumbers[captureQueueSize];
+	atomic<unsigned int> head;
+	atomic<unsigned int> tail;
+	atomic<bool> running;
+	atomic<unsigned int> written;
+	thread writer;
+
+	unsigned int dropped; // Writer was too far behind
+	unsigned int writerWaits; // Or we waited for it, when lossless
+	unsigned int skipped; // Window wasn't the size we started at
+	unsigned int stalls; // Ran out of PBOs and had to wait on the GPU
+
+	// What it costs the game thread
+	uint64_t totalNs;
+	uint64_t maxNs;
+	unsigned int noCaptured;
+};
+
+FrameCapture frameCapture;
+
+// Full range BT.601 (what Y4M's C420jpeg means), flipped so the top row comes first
+void rgbaToYuv420(const unsigned char* rgba, unsigned int width, unsigned int height, unsigned char* yuv) {
+	unsigned int chromaWidth = (width + 1) / 2;
+	unsigned int chromaHeight = (height + 1) / 2;
+	unsigned char* yPlane = yuv;
+	unsigned char* uPlane = yuv + width * height;
+	unsigned char* vPlane = uPlane + chromaWidth * chromaHeight;
+
+	for (unsigned int y = 0; y < height; y++) {
+		const unsigned char* src = rgba + (height - 1 - y) * width * 4;
+		for (unsigned int x = 0; x < width; x++) {
+			yPlane[y * width + x] = (unsigned char)((77 * src[x * 4] + 150 * src[x * 4 + 1] + 29 * src[x * 4 + 2] + 128) >> 8);
+		}
+	}
+
+	// Each chroma sample is the average of a 2x2 block, the last row/column repeats on odd sizes
+	for (unsigned int cy = 0; cy < chromaHeight; cy++) {
+		const unsigned char* row0 = rgba + (height - 1 - 2 * cy) * width * 4;
+		const unsigned char* row1 = rgba + (height - 1 - min(2 * cy + 1, height - 1)) * width * 4;
+		for (unsigned int cx = 0; cx < chromaWidth; cx++) {
+			unsigned int x0 = 2 * cx * 4;
+			unsigned int x1 = min(2 * cx + 1, width - 1) * 4;
+			int r = row0[x0] + row0[x1] + row1[x0] + row1[x1];
+			int g = row0[x0 + 1] + row0[x1 + 1] + row1[x0 + 1] + row1[x1 + 1];
+			int b = row0[x0 + 2] + row0[x1 + 2] + row1[x0 + 2] + row1[x1 + 2];
+			int u = 128 + (-43 * r - 85 * g + 128 * b + 512) / 1024;
+			int v = 128 + (128 * r - 107 * g - 21 * b + 512) / 1024;
+			uPlane[cy * chromaWidth + cx] = (unsigned char)min(max(u, 0), 255);
+			vPlane[cy * chromaWidth + cx] = (unsigned char)min(max(v, 0), 255);
+		}
+	}
+}
+
+void captureWriterThread(FrameCapture* capture) {
+	PROFILE_THREAD("Capture Writer");
+	samplerRegisterThread();
+
+	unsigned int width = capture->width;
+	unsigned int height = capture->height;
+	unsigned int yuvBytes = width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2);
+	unsigned char* yuv = nullptr;
+	ofstream video;
+
+	if (capture->y4m) {
+		video.open(capture->filename, ios::binary);
+		if (!video.is_open()) {
+			cout << "File could not be opened " << capture->filename << endl;
+		}
+		video << "YUV4MPEG2 W" << width << " H" << height << " F" << capture->fps << ":1 Ip A1:1 C420jpeg\n";
+		yuv = new unsigned char[yuvBytes];
+	}
+
+	// Numbered frames go next to the name we were given, minus its extension
+	string base = capture->filename;
+	size_t dot = base.find_last_of('.');
+	if (dot != string::npos && base.find_first_of("/\\", dot) == string::npos) {
+		base.erase(dot);
+	}
+
+	while (true) {
+		// Check before looking at the queue so we can't miss the last frames
+		bool stopping = !capture->running.load(memory_order_acquire);
+		unsigned int tail = capture->tail.load(memory_order_relaxed);
+		if (tail == capture->head.load(memory_order_acquire)) {
+			if (stopping) {
+				break;
+			}
+			this_thread::sleep_for(chrono::milliseconds(1));
+			continue;
+		}
+
+		unsigned int slot = tail & (captureQueueSize - 1);
+		PROFILE_BEGIN("writeFrame");
+		if (capture->y4m) {
+			rgbaToYuv420(capture->pixels[slot], width, height, yuv);
+			video << "FRAME\n";
+			video.write((char*)yuv, yuvBytes);
+		}
+		else {
+			char name[512];
+			snprintf(name, sizeof(name), "%s_%05u.tga", base.c_str(), capture->frameNumbers[slot]);
+			saveImage(name, { width, height, capture->pixels[slot] });
+		}
+		PROFILE_END();
+
+		capture->written.fetch_add(1, memory_order_relaxed);
+		capture->tail.store(tail + 1, memory_order_release);
+	}
+
+	if (capture->y4m && !video) {
+		cout << "Writing " << capture->filename << " failed" << endl;
+	}
+	delete[] yuv;
+}
+
+// Call once the context is current, the capture is the size of the window right now
+void genFrameCapture(FrameCapture& capture, const char* filename, unsigned int width, unsigned int height, unsigned int fps, bool lossless) {
+	size_t length = strlen(filename);
+	capture.filename = filename;
+	capture.y4m = length >= 4 && strcmp(filename + length - 4, ".y4m") == 0;
+	capture.width = width;
+	capture.height = height;
+	capture.fps = fps;
+	capture.lossless = lossless;
+
+	unsigned int frameBytes = width * height * 4;
+	for (unsigned int i = 0; i < capturePBOs; i++) {
+		glGenBuffers(1, &capture.readbacks[i].pbo);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, capture.readbacks[i].pbo);
+		glBufferData(GL_PIXEL_PACK_BUFFER, frameBytes, nullptr, GL_STREAM_READ);
+		capture.readbacks[i].fence = nullptr;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	capture.oldestReadback = 0;
+	capture.noReadbacks = 0;
+	capture.frame = 0;
+
+	for (unsigned int i = 0; i < captureQueueSize; i++) {
+		capture.pixels[i] = new unsigned char[frameBytes];
+	}
+	capture.head = 0;
+	capture.tail = 0;
+	capture.written = 0;
+	capture.dropped = 0;
+	capture.writerWaits = 0;
+	capture.skipped = 0;
+	capture.stalls = 0;
+	capture.totalNs = 0;
+	capture.maxNs = 0;
+	capture.noCaptured = 0;
+
+	capture.running = true;
+	capture.writer = thread(captureWriterThread, &capture);
+	capture.active = true;
+
+	cout << "Capturing " << width << "x" << height << " to " << filename << endl;
+}
+
+// Pass the oldest frame in flight to the writer, if the GPU's done with it
+// With wait set we block until it is, returns false if there was nothing to pass on
+bool captureCollect(FrameCapture& capture, bool wait) {
+	if (capture.noReadbacks == 0) {
+		return false;
+	}
+
+	CaptureReadback& readback = capture.readbacks[capture.oldestReadback];
+	GLenum status = glClientWaitSync(readback.fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? 1000000000 : 0);
+	if (status == GL_TIMEOUT_EXPIRED) {
+		return false;
+	}
+	glDeleteSync(readback.fence);
+	readback.fence = nullptr;
+
+	// Can't tell if the GPU's written the PBO, and mapping it might block forever, so drop the frame
+	if (status == GL_WAIT_FAILED) {
+		capture.dropped++;
+		capture.oldestReadback = (capture.oldestReadback + 1) % capturePBOs;
+		capture.noReadbacks--;
+		return true;
+	}
+
+	unsigned int head = capture.head.load(memory_order_relaxed);
+	if (capture.lossless && head - capture.tail.load(memory_order_acquire) == captureQueueSize) {
+		capture.writerWaits++;
+		while (head - capture.tail.load(memory_order_acquire) == captureQueueSize) {
+			this_thread::yield();
+		}
+	}
+	if (head - capture.tail.load(memory_order_acquire) == captureQueueSize) {
+		capture.dropped++;
+	}
+	else {
+		unsigned int slot = head & (captureQueueSize - 1);
+		unsigned int frameBytes = capture.width * capture.height * 4;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+		void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frameBytes, GL_MAP_READ_BIT);
+		if (mapped) {
+			memcpy(capture.pixels[slot], mapped, frameBytes);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			capture.frameNumbers[slot] = readback.frame;
+			capture.head.store(head + 1, memory_order_release);
+		}
+		else {
+			capture.dropped++;
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+
+	capture.oldestReadback = (capture.oldestReadback + 1) % capturePBOs;
+	capture.noReadbacks--;
+	return true;
+}
+
+// Start reading back the frame that's just been drawn, call before swapping
+void captureFrame(FrameCapture& capture) {
+	if (!capture.active) {
+		return;
+	}
+	PROFILE_ZONE("capture");
+
+	if (scrWidth != capture.width || scrHeight != capture.height) {
+		if (capture.skipped++ == 0) {
+			cout << "Window isn't " << capture.width << "x" << capture.height << " anymore, not capturing until it is" << endl;
+		}
+		return;
+	}
+
+	uint64_t start = profilerNow();
+
+	// Anything the GPU's finished with
+	while (captureCollect(capture, false)) {}
+
+	// The GPU's more than capturePBOs frames behind, nothing for it but to wait
+	if (capture.noReadbacks == capturePBOs) {
+		capture.stalls++;
+		if (!captureCollect(capture, true)) {
+			capture.dropped++;
+			return;
+		}
+	}
+
+	CaptureReadback& readback = capture.readbacks[(capture.oldestReadback + capture.noReadbacks) % capturePBOs];
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+	glReadPixels(0, 0, capture.width, capture.height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	readback.frame = capture.frame++;
+	capture.noReadbacks++;
+
+	uint64_t elapsed = profilerNow() - start;
+	capture.totalNs += elapsed;
+	capture.maxNs = max(capture.maxNs, elapsed);
+	capture.noCaptured++;
+}
+
+// Finish off everything in flight, stop the writer and say how it went
+void cleanup(FrameCapture& capture) {
+	if (!capture.active) {
+		return;
+	}
+
+	while (captureCollect(capture, true)) {}
+	capture.running.store(false, memory_order_release);
+	capture.writer.join();
+
+	for (unsigned int i = 0; i < capturePBOs; i++) {
+		if (capture.readbacks[i].fence) {
+			glDeleteSync(capture.readbacks[i].fence);
+		}
+		glDeleteBuffers(1, &capture.readbacks[i].pbo);
+	}
+	for (unsigned int i = 0; i < captureQueueSize; i++) {
+		delete[] capture.pixels[i];
+	}
+
+	cout << "Captured " << capture.written.load() << " frames to " << capture.filename << ", dropped " << capture.dropped
+		<< ", skipped " << capture.skipped << ", " << capture.stalls << " GPU stalls, waited on the writer " << capture.writerWaits << " times" << endl;
+	if (capture.noCaptured) {
+		cout << "Capture cost " << capture.totalNs / 1e6 / capture.noCaptured << " ms per frame on the game thread, "
+			<< capture.maxNs / 1e6 << " ms max" << endl;
+	}
+	capture.active = false;
+}
+
+//
+// Resource Uploads
+//
+
+// Creating buffers and textures (and loading the files behind them) on the render thread
+// hitches whatever frame it happens in. So an upload thread with its own context, shared with
+// the window's, does the work instead: the render thread queues a request, the upload thread
+// loads/creates/fills the object and drops a fence in after it, and the render thread picks up
+// the handle once that fence has gone by, so the data's all there before it gets used. Object
+// names are shared between the contexts but VAOs aren't, so those still get made on the
+// render thread from the buffers that come back.
+// If the shared context can't be made, requests just get done on the spot.
+const unsigned int uploadQueueSize = 32; // Power of 2
+const unsigned int maxUploadPath = 256;
+
+enum UploadKind {
+	UPLOAD_BUFFER,
+	UPLOAD_TEXTURE_FILE
+};
+
+struct UploadRequest {
+	unsigned int id;
+	UploadKind kind;
+	GLenum target; // Buffers only
+	GLenum usage;
+	unsigned char* data; // Copy of the caller's data, the upload thread frees it
+	unsigned int size;
+	char path[maxUploadPath]; // Texture files only
+};
+
+struct UploadResult {
+	unsigned int id;
+	UploadKind kind;
+	GLuint handle; // 0 if it failed
+	unsigned int width, height; // Textures only
+	GLsync fence;
+};
+
+struct ResourceUploader {
+	GLFWwindow* context; // Hidden window whose context shares with the main one, nullptr if we're synchronous
+	thread worker;
+	atomic<bool> running;
+	unsigned int nextId;
+
+	// Render thread -> upload thread
+	UploadRequest requests[uploadQueueSize];
+	atomic<unsigned int> requestHead;
+	atomic<unsigned int> requestTail;
+
+	// Upload thread -> render thread
+	UploadResult results[uploadQueueSize];
+	atomic<unsigned int> resultHead;
+	atomic<unsigned int> resultTail;
+
+	// For when a fence can't be waited on, the render thread asks for a glFinish on the upload context
+	atomic<unsigned int> finishRequests;
+	atomic<unsigned int> finishesDone;
+
+	// Signalled whenever a result or a finish is done, so the render thread can sleep when it
+	// has to wait (startup, replays, finishUploads) instead of spinning
+	mutex progressMutex;
+	condition_variable progress;
+};
+
+ResourceUploader resourceUploader;
+
+// Upload thread, after publishing something the render thread might be waiting for
+// Taking the lock means a waiter is either before its check or already asleep, so it can't miss this
+void uploadSignalProgress(ResourceUploader* uploader) {
+	lock_guard<mutex> lock(uploader->progressMutex);
+	uploader->progress.notify_all();
+}
+
+// Does the actual GL work, on whichever thread has a context
+void processUpload(UploadRequest& request, UploadResult& result) {
+	result = { request.id, request.kind, 0, 0, 0, nullptr };
+
+	if (request.kind == UPLOAD_BUFFER) {
+		genBufferObject<unsigned char>(result.handle, request.target, request.size, request.data, request.usage);
+		glBindBuffer(request.target, 0);
+		delete[] request.data;
+	}
+	else {
+		Image image;
+		if (loadImage(request.path, image)) {
+			glGenTextures(1, &result.handle);
+			glBindTexture(GL_TEXTURE_2D, result.handle);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, image.width, image.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.pixels);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			result.width = image.width;
+			result.height = image.height;
+			cleanup(image);
+		}
+	}
+
+	// The flush makes sure the fence actually gets to the GPU, otherwise the other context could wait on it forever
+	result.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glFlush();
+}
+
+void uploadThread(ResourceUploader* uploader) {
+	PROFILE_THREAD("Uploads");
+	samplerRegisterThread();
+	glfwMakeContextCurrent(uploader->context);
+
+	while (true) {
+		unsigned int finishes = uploader->finishRequests.load(memory_order_acquire);
+		if (finishes != uploader->finishesDone.load(memory_order_relaxed)) {
+			glFinish();
+			uploader->finishesDone.store(finishes, memory_order_release);
+			uploadSignalProgress(uploader);
+		}
+
+		bool stopping = !uploader->running.load(memory_order_acquire);
+		unsigned int tail = uploader->requestTail.load(memory_order_relaxed);
+		if (tail == uploader->requestHead.load(memory_order_acquire)) {
+			if (stopping) {
+				break;
+			}
+			this_thread::sleep_for(chrono::milliseconds(1));
+			continue;
+		}
+
+		// Results have as many slots as requests and the render thread only queues a request
+		// when both have room, so there's always somewhere for this to go
+		PROFILE_BEGIN("upload");
+		unsigned int head = uploader->resultHead.load(memory_order_relaxed);
+		processUpload(uploader->requests[tail & (uploadQueueSize - 1)], uploader->results[head & (uploadQueueSize - 1)]);
+		uploader->resultHead.store(head + 1, memory_order_release);
+		uploader->requestTail.store(tail + 1, memory_order_release);
+		PROFILE_END();
+		uploadSignalProgress(uploader);
+
+		// In case the render thread's idling in glfwWaitEvents
+		glfwPostEmptyEvent();
+	}
+
+	// Whatever's left is done by the time the render thread's joined us
+	glFinish();
+	glfwMakeContextCurrent(nullptr);
+}
+
+// Call on the main thread once the window's made (GLFW only makes windows there)
+void genResourceUploader(ResourceUploader& uploader, GLFWwindow* window) {
+	uploader.nextId = 1;
+	uploader.requestHead = 0;
+	uploader.requestTail = 0;
+	uploader.resultHead = 0;
+	uploader.resultTail = 0;
+	uploader.finishRequests = 0;
+	uploader.finishesDone = 0;
+
+	// Only this window is hidden, the version hints from initGLFW have to stay so the contexts match
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	uploader.context = glfwCreateWindow(1, 1, "Uploads", NULL, window);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+	if (!uploader.context) {
+		cout << "Shared upload context could not be created, uploading on the render thread" << endl;
+		return;
+	}
+
+	uploader.running = true;
+	uploader.worker = thread(uploadThread, &uploader);
+}
+
+// Grab the next request slot, returns nullptr if the queue's full (try again next frame)
+UploadRequest* beginUpload(ResourceUploader& uploader, UploadKind kind) {
+	unsigned int head = uploader.requestHead.load(memory_order_relaxed);
+	unsigned int inFlight = head - uploader.resultTail.load(memory_order_acquire);
+	if (inFlight >= uploadQueueSize) {
+		return nullptr;
+	}
+
+	UploadRequest* request = &uploader.requests[head & (uploadQueueSize - 1)];
+	request->id = uploader.nextId++;
+	request->kind = kind;
+	return request;
+}
+
+// Hand it over, or do it right now if there's no upload thread
+unsigned int submitUpload(ResourceUploader& uploader, UploadRequest* request) {
+	unsigned int head = uploader.requestHead.load(memory_order_relaxed);
+	if (!uploader.context) {
+		unsigned int resultHead = uploader.resultHead.load(memory_order_relaxed);
+		processUpload(*request, uploader.results[resultHead & (uploadQueueSize - 1)]);
+		uploader.resultHead.store(resultHead + 1, memory_order_release);
+		uploader.requestTail.store(head + 1, memory_order_release);
+	}
+	uploader.requestHead.store(head + 1, memory_order_release);
+	return request->id;
+}
+
+// Same arguments as genBufferObject (the data gets copied), returns the id the result will have, 0 if the queue's full
+template<typename T>
+unsigned int uploadBuffer(ResourceUploader& uploader, GLenum type, GLuint noElements, T* data, GLenum usage) {
+	UploadRequest* request = beginUpload(uploader, UPLOAD_BUFFER);
+	if (!request) {
+		return 0;
+	}
+
+	request->target = type;
+	request->usage = usage;
+	request->size = noElements * sizeof(T);
+	request->data = nullptr;
+	if (data) {
+		request->data = new unsigned char[request->size];
+		memcpy(request->data, data, request->size);
+	}
+	return submitUpload(uploader, request);
+}
+
+// Load a TGA into its own texture, returns the id the result will have, 0 if the queue's full
+unsigned int uploadTextureFile(ResourceUploader& uploader, const char* filename) {
+	UploadRequest* request = beginUpload(uploader, UPLOAD_TEXTURE_FILE);
+	if (!request) {
+		return 0;
+	}
+
+	snprintf(request->path, maxUploadPath, "%s", filename);
+	return submitUpload(uploader, request);
+}
+
+// Wait until everything the upload thread has done so far has finished on the GPU, the slow
+// way round for when we can't wait on its fences
+void finishUploads(ResourceUploader& uploader) {
+	if (!uploader.context || !uploader.running.load(memory_order_acquire)) {
+		glFinish(); // Synchronous (or the thread's already finished everything on its way out)
+		return;
+	}
+
+	unsigned int request = uploader.finishRequests.fetch_add(1, memory_order_release) + 1;
+	unique_lock<mutex> lock(uploader.progressMutex);
+	uploader.progress.wait(lock, [&]() {
+		return (int)(uploader.finishesDone.load(memory_order_acquire) - request) >= 0;
+	});
+}
+
+// Render thread, returns true and fills result if the oldest upload is ready to use
+// With wait set it blocks until the next one is (for replays, which need everything from frame one)
+bool pollUpload(ResourceUploader& uploader, UploadResult& result, bool wait = false) {
+	unsigned int tail = uploader.resultTail.load(memory_order_relaxed);
+	do {
+		if (tail != uploader.resultHead.load(memory_order_acquire)) {
+			UploadResult& next = uploader.results[tail & (uploadQueueSize - 1)];
+			GLenum status = glClientWaitSync(next.fence, 0, wait ? 1000000 : 0);
+			if (status == GL_WAIT_FAILED) {
+				cout << "Waiting on upload " << next.id << "'s fence failed (GL error " << glGetError() << "), finishing the upload context instead" << endl;
+				finishUploads(uploader);
+				status = GL_ALREADY_SIGNALED;
+			}
+			if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+				result = next;
+				glDeleteSync(next.fence);
+				result.fence = nullptr;
+				uploader.resultTail.store(tail + 1, memory_order_release);
+				return true;
+			}
+		}
+		else if (wait && uploader.requestTail.load(memory_order_acquire) == uploader.requestHead.load(memory_order_relaxed)) {
+			// The upload thread moves resultHead before requestTail, so if a result came in since
+			// we looked it's visible now, go round again for it
+			if (uploader.resultHead.load(memory_order_acquire) == tail) {
+				return false; // Nothing left to wait for
+			}
+		}
+		else if (wait) {
+			// Sleep until the upload thread hands something back (the timeout's just a backstop)
+			unique_lock<mutex> lock(uploader.progressMutex);
+			uploader.progress.wait_for(lock, chrono::milliseconds(100), [&]() {
+				return uploader.resultHead.load(memory_order_acquire) != tail;
+			});
+		}
+	} while (wait);
+	return false;
+}
+
+// A game mesh (see Game Meshes) whose buffers come from the upload thread
+struct MeshUpload {
+	unsigned int posUpload;
+	unsigned int instanceUpload;
+	unsigned int eboUpload;
+	unsigned int noReady; // Buffers we've got back so far
+	VAO vao;
+};
+
+// vertices are 2D positions, noVertexFloats of them, same layout as genPaddleVAO/genPongVAO
+void uploadMesh(ResourceUploader& uploader, MeshUpload& mesh, const float* vertices, GLuint noVertexFloats, const GLuint* indices, GLuint noIndices) {
+	mesh.vao = { 0, 0, 0, 0 };
+	mesh.noReady = 0;
+	mesh.posUpload = uploadBuffer(uploader, GL_ARRAY_BUFFER, noVertexFloats, vertices, GL_STATIC_DRAW);
+	mesh.instanceUpload = uploadBuffer<InstanceData>(uploader, GL_ARRAY_BUFFER, maxInstancesPerMesh, nullptr, GL_DYNAMIC_DRAW);
+	mesh.eboUpload = uploadBuffer(uploader, GL_ELEMENT_ARRAY_BUFFER, noIndices, indices, GL_STATIC_DRAW);
+}
+
+bool meshUploaded(MeshUpload& mesh) {
+	return mesh.vao.val != 0;
+}
+
+// Returns true if result was one of mesh's buffers, and puts the VAO together once we have all three
+// (VAOs aren't shared between contexts, so this bit has to happen on the render thread)
+bool receiveMeshUpload(MeshUpload& mesh, const UploadResult& result) {
+	if (result.id == mesh.posUpload) {
+		mesh.vao.posVBO = result.handle;
+	}
+	else if (result.id == mesh.instanceUpload) {
+		mesh.vao.instanceVBO = result.handle;
+	}
+	else if (result.id == mesh.eboUpload) {
+		mesh.vao.EBO = result.handle;
+	}
+	else {
+		return false;
+	}
+
+	if (++mesh.noReady == 3) {
+		genVAO(&mesh.vao);
+		setAttPointer<float>(mesh.vao.posVBO, 0, 2, GL_FLOAT, 2, 0);
+		setInstanceAttPointers(mesh.vao.instanceVBO);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.vao.EBO);
+		unbindBuffer(GL_ARRAY_BUFFER);
+		unbindVAO();
+	}
+	return true;
+}
+
+// Stop the thread, anything still in flight gets thrown away
+void cleanup(ResourceUploader& uploader) {
+	if (uploader.context) {
+		uploader.running.store(false, memory_order_release);
+		uploader.worker.join();
+	}
+
+	UploadResult result;
+	while (pollUpload(uploader, result, true)) {
+		if (result.kind == UPLOAD_BUFFER) {
+			glDeleteBuffers(1, &result.handle);
+		}
+		else {
+			glDeleteTextures(1, &result.handle);
+		}
+	}
+
+	if (uploader.context) {
+		glfwDestroyWindow(uploader.context);
+		uploader.context = nullptr;
+	}
+}
+
+//
+// Main Loops
+//
+
+// Display the Score
+// This just updates the HUD text, it gets laid out next time the HUD is drawn
+void displayScore() {
+	char score[maxTextLength];
+	snprintf(score, maxTextLength, "%u - %u", leftScore, rightScore);
+	setText(hudText, scoreTextItem, score,
+		{ (scrWidth - textWidth(score, scoreTextHeight)) / 2.0f, scrHeight - scoreTextHeight - 20.0f },
+		scoreTextHeight, { 1.0f, 1.0f, 1.0f, 1.0f });
+}
+
+// Window Size changer
+// GLFW can call this from any glfwPollEvents, including late latch's in the middle of
+// recording a frame, so it only notes the new size and applyResize does the work at the
+// top of the next frame
+int pendingWidth = 0;
+int pendingHeight = 0;
+bool resizePending = false;
+
+void framebufferSizeCallback(GLFWwindow* window, int width, int height) {
+	redrawRequested = true;
+
+	// Minimized, keep the last real size so the game doesn't think the window's 0 wide
+	if (width == 0 || height == 0) {
+		return;
+	}
+
+	pendingWidth = width;
+	pendingHeight = height;
+	resizePending = true;
+}
+
+// Call before anything in the frame looks at the window size
+void applyResize() {
+	if (!resizePending) {
+		return;
+	}
+	resizePending = false;
+	redrawRequested = true; // In case the resize came in while we were drawing the last frame
+
+	int width = pendingWidth;
+	int height = pendingHeight;
+	glViewport(0, 0, width, height);
+	scrWidth = width;
+	scrHeight = height;
+	resizeOffscreenScreen(width, height);
+	resizeDynamicResolution(dynamicResolution, width, height);
+
+	//Update Projection Matrix (for every program we know about)
+	for (unsigned int i = 0; i < renderTables.noPrograms; i++) {
+		setOrthographicProjection(renderTables.programs[i], 0, width, 0, height, 0.0f, 1.0f);
+	}
+
+	// Update right padel pos
+	paddleOffsets[1].x = width - 35.0f; 
+
+	// Keep the score centered
+	displayScore();
+}
+
+// Input Processor
+// Turn a tick of input into paddle velocities and pausing
+// This is the only way input gets into the simulation, so feeding it recorded snapshots replays a game exactly.
+// Paddles move for however much of the tick their up/down was held, so a quick tap moves
+// a paddle a little instead of a whole frame's worth (or not at all)
+void applyInput(const InputSnapshot& input) {
+	for (unsigned int i = 0; i < 2; i++) {
+		float up = input.held[i][0] / 255.0f;
+		float down = input.held[i][1] / 255.0f;
+
+		// Stop at the edges of the window, a key pushing into one does nothing
+		if (up > 0.0f && paddleOffsets[i].y >= scrHeight - paddleBoundary) {
+			paddleOffsets[i].y = scrHeight - paddleBoundary;
+			up = 0.0f;
+		}
+		if (down > 0.0f && paddleOffsets[i].y <= paddleBoundary) {
+			paddleOffsets[i].y = paddleBoundary;
+			down = 0.0f;
+		}
+
+		// With both held, the key that always won wins (S for the left paddle, Up for the right),
+		// for as much of the frame as the two could have overlapped
+		if (i == 0) {
+			up = min(up, 1.0f - down);
+		}
+		else {
+			down = min(down, 1.0f - up);
+		}
+
+		paddleVelocity[i] = paddleSpeed * (up - down);
+	}
+
+	// Either player can pause, every press toggles it no matter how short
+	if ((input.pressed[0] | input.pressed[1]) & ACTION_PAUSE) {
+		pauseMe = !pauseMe;
+		gameSpeed = pauseMe ? 0.0f : 1.0f;
+	}
+}
+
+// Everything back to how a new game starts
+void resetGame() {
+	paddleOffsets[0] = { 35.0f, scrHeight / 2.0f };
+	paddleOffsets[1] = { scrWidth - 35.0f, scrHeight / 2.0f };
+
+	paddleVelocity[0] = 0.0f;
+	paddleVelocity[1] = 0.0f;
+
+	pongOffset = { scrWidth / 2.0f, scrHeight / 2.0f };
+	pongVelocity = pongVelocityInitial;
+
+	leftScore = 0;
+	rightScore = 0;
+	pauseMe = false;
+	gameSpeed = 1.0f;
+}
+
+// Move everything and sort out collisions and scoring for one step of dt
+void simulateFrame(double dt, unsigned int& framesSinceCollided) {
+	PROFILE_BEGIN("physics");
+
+	//Update Paddle Position
+	movePaddles(paddleOffsets, paddleVelocity, 2, dt, gameSpeed);
+
+	// Update Pong Position
+	moveBall(pongOffset, pongVelocity, dt, gameSpeed);
+
+	////
+	// Check collision
+	////
+	PROFILE_BEGIN("collision");
+
+	// Pong Ball Collision with the window
+	unsigned char pongReset = collideBallWithWindow(pongOffset, pongVelocity);
+	if (pongReset == 1) {
+		rightScore++;
+	}
+	else if (pongReset == 2) {
+		leftScore++;
+	}
+
+	// Resets pong's pos and velocity
+	if (pongReset) {
+		resetBall(pongOffset, pongVelocity, pongReset);
+		displayScore();
+	}
+
+	// Paddle Collision with Pong ball
+	collideBallWithPaddles(pongOffset, pongVelocity, paddleOffsets, paddleVelocity, framesSinceCollided);
+
+	PROFILE_END(); // collision
+	PROFILE_END(); // physics
+}
+
+
+// Screen clearer
+void clearScreen() {
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+}
+
+// New Frame
+// Input gets polled after the pacing wait so it's as fresh as it can be
+void newFrame(GLFWwindow* window) {
+	glfwSwapBuffers(window);
+	pacerThrottleQueue(framePacer);
+	pacerLimit(framePacer);
+	glfwPollEvents();
+}
+
+//
+// Cleanupers
+//
+void cleanup() {
+	glfwTerminate();
+}
+
+//
+// Replays
+//
+
+// --record <file> saves the input (and dt) of every frame, --replay <file> plays it back
+// with a fixed timestep in a hidden window (or with no window at all if there isn't one)
+// and collects frame timings and allocations. Input only reaches the game through
+// applyInput, so a replay runs exactly the same game every time.
+//
+// --write-baseline <file> saves the run's p50/p99, --baseline <file> compares against one
+// and the exe returns 1 if either got worse by more than --tolerance percent (default 10).
+const double replayDt = 1.0 / 60.0;
+const unsigned int maxReplayFrames = 60 * 60 * 60; // An hour at 60 fps
+const float replayNoiseMs = 0.05f; // Frame time changes smaller than this never count as a regression
+
+struct ReplayFrame {
+	float dt; // What it was when recorded, replays use replayDt
+	InputSnapshot input;
+};
+
+struct Replay {
+	ReplayFrame* frames;
+	unsigned int noFrames;
+};
+
+void genReplay(Replay& replay) {
+	replay.frames = new ReplayFrame[maxReplayFrames];
+	replay.noFrames = 0;
+}
+
+void replayRecord(Replay& replay, double dt, const InputSnapshot& input) {
+	if (replay.noFrames == maxReplayFrames) {
+		return;
+	}
+	replay.frames[replay.noFrames++] = { (float)dt, input };
+}
+
+// Plain text, a header then "dt actions pressed held" per frame, with every player's in a row
+bool saveReplay(Replay& replay, const char* filename) {
+	ofstream file(filename);
+	if (!file.is_open()) {
+		cout << "File could not be opened " << filename << endl;
+		return false;
+	}
+
+	file << "moreplay 1 " << replay.noFrames << "\n";
+	for (unsigned int i = 0; i < replay.noFrames; i++) {
+		InputSnapshot& input = replay.frames[i].input;
+		file << replay.frames[i].dt;
+		for (unsigned int p = 0; p < maxPlayers; p++) {
+			file << " " << (unsigned int)input.actions[p] << " " << (unsigned int)input.pressed[p]
+				<< " " << (unsigned int)input.held[p][0] << " " << (unsigned int)input.held[p][1];
+		}
+		file << "\n";
+	}
+	return true;
+}
+
+bool loadReplay(Replay& replay, const char* filename) {
+	ifstream file(filename);
+	if (!file.is_open()) {
+		cout << "File could not be opened " << filename << endl;
+		return false;
+	}
+
+	string magic;
+	unsigned int version = 0;
+	unsigned int noFrames = 0;
+	file >> magic >> version >> noFrames;
+	if (magic != "moreplay" || version != 1) {
+		cout << "Not a replay file " << filename << endl;
+		return false;
+	}
+
+	replay.noFrames = 0;
+	ReplayFrame frame = {};
+	while (replay.noFrames < min(noFrames, maxReplayFrames) && file >> frame.dt) {
+		for (unsigned int p = 0; p < maxPlayers; p++) {
+			unsigned int actions, pressed, up, down;
+			file >> actions >> pressed >> up >> down;
+			frame.input.actions[p] = (uint8_t)actions;
+			frame.input.pressed[p] = (uint8_t)pressed;
+			frame.input.held[p][0] = (uint8_t)up;
+			frame.input.held[p][1] = (uint8_t)down;
+		}
+
+		if (!file) {
+			break;
+		}
+		replay.frames[replay.noFrames++] = frame;
+	}
+	return true;
+}
+
+void cleanup(Replay& replay) {
+	delete[] replay.frames;
+}
+
+// Per frame numbers from a replay run
+struct ReplayStats {
+	float* frameMs;
+	unsigned int* allocations;
+	unsigned int noFrames;
+
+	// GPU results come in a few frames late and only when we drew, so they're counted separately
+	float* gpuMs;
+	unsigned int noGpuFrames;
+};
+
+void genReplayStats(ReplayStats& stats) {
+	stats.frameMs = new float[maxReplayFrames];
+	stats.allocations = new unsigned int[maxReplayFrames];
+	stats.noFrames = 0;
+	stats.gpuMs = new float[maxReplayFrames];
+	stats.noGpuFrames = 0;
+}
+
+void replayStatsAddFrame(ReplayStats& stats, float ms, unsigned int allocations) {
+	if (stats.noFrames == maxReplayFrames) {
+		return;
+	}
+	stats.frameMs[stats.noFrames] = ms;
+	stats.allocations[stats.noFrames] = allocations;
+	stats.noFrames++;
+}
+
+void replayStatsAddGpuFrame(ReplayStats& stats, float ms) {
+	if (stats.noGpuFrames == maxReplayFrames) {
+		return;
+	}
+	stats.gpuMs[stats.noGpuFrames++] = ms;
+}
+
+void cleanup(ReplayStats& stats) {
+	delete[] stats.frameMs;
+	delete[] stats.allocations;
+	delete[] stats.gpuMs;
+}
+
+// What gets compared between runs
+struct ReplaySummary {
+	unsigned int frames;
+	float p50Ms;
+	float p99Ms;
+	float maxMs;
+	float gpuP50Ms; // 0 when nothing got drawn (no window, or no timer queries)
+	float gpuP99Ms;
+	float allocationsPerFrame;
+	uint32_t stateHash; // Game state at the end, should never change unless the game did
+};
+
+ReplaySummary summarizeReplay(ReplayStats& stats) {
+	ReplaySummary summary = { stats.noFrames, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, hashGameState() };
+
+	float* sorted = new float[stats.noFrames + 1];
+	memcpy(sorted, stats.frameMs, stats.noFrames * sizeof(float));
+	sort(sorted, sorted + stats.noFrames);
+	summary.p50Ms = percentile(sorted, stats.noFrames, 0.50f);
+	summary.p99Ms = percentile(sorted, stats.noFrames, 0.99f);
+	summary.maxMs = stats.noFrames ? sorted[stats.noFrames - 1] : 0.0f;
+	delete[] sorted;
+
+	if (stats.noGpuFrames) {
+		sorted = new float[stats.noGpuFrames];
+		memcpy(sorted, stats.gpuMs, stats.noGpuFrames * sizeof(float));
+		sort(sorted, sorted + stats.noGpuFrames);
+		summary.gpuP50Ms = percentile(sorted, stats.noGpuFrames, 0.50f);
+		summary.gpuP99Ms = percentile(sorted, stats.noGpuFrames, 0.99f);
+		delete[] sorted;
+	}
+
+	uint64_t allocations = 0;
+	for (unsigned int i = 0; i < stats.noFrames; i++) {
+		allocations += stats.allocations[i];
+	}
+	summary.allocationsPerFrame = stats.noFrames ? (float)allocations / stats.noFrames : 0.0f;
+
+	return summary;
+}
+
+void writeReplaySummary(ReplaySummary& summary, const char* filename) {
+	ofstream file(filename);
+	if (!file.is_open()) {
+		cout << "File could not be opened " << filename << endl;
+		return;
+	}
+
+	char json[320];
+	snprintf(json, sizeof(json), "{\"frames\":%u,\"p50_ms\":%.4f,\"p99_ms\":%.4f,\"max_ms\":%.4f,\"gpu_p50_ms\":%.4f,\"gpu_p99_ms\":%.4f,\"allocations_per_frame\":%.3f,\"state_hash\":%u}\n",
+		summary.frames, summary.p50Ms, summary.p99Ms, summary.maxMs, summary.gpuP50Ms, summary.gpuP99Ms, summary.allocationsPerFrame, summary.stateHash);
+	file << json;
+}
+
+// Just enough JSON to read back what writeReplaySummary wrote
+double jsonNumber(const string& json, const char* key, double fallback) {
+	string quoted = string("\"") + key + "\":";
+	size_t at = json.find(quoted);
+	if (at == string::npos) {
+		return fallback;
+	}
+	return strtod(json.c_str() + at + quoted.size(), nullptr);
+}
+
+bool loadReplaySummary(ReplaySummary& summary, const char* filename) {
+	if (!fileExists(filename)) {
+		cout << "File could not be opened " << filename << endl;
+		return false;
+	}
+
+	string json = readFile(filename);
+	summary.frames = (unsigned int)jsonNumber(json, "frames", 0);
+	summary.p50Ms = (float)jsonNumber(json, "p50_ms", 0);
+	summary.p99Ms = (float)jsonNumber(json, "p99_ms", 0);
+	summary.maxMs = (float)jsonNumber(json, "max_ms", 0);
+	summary.gpuP50Ms = (float)jsonNumber(json, "gpu_p50_ms", 0);
+	summary.gpuP99Ms = (float)jsonNumber(json, "gpu_p99_ms", 0);
+	summary.allocationsPerFrame = (float)jsonNumber(json, "allocations_per_frame", 0);
+	summary.stateHash = (uint32_t)jsonNumber(json, "state_hash", 0);
+	return true;
+}
+
+void printReplaySummary(const char* label, ReplaySummary& summary) {
+	char line[256];
+	snprintf(line, sizeof(line), "%-9s %6u frames  p50 %7.3f ms  p99 %7.3f ms  max %7.3f ms  gpu p50 %7.3f ms  p99 %7.3f ms  %6.2f allocs/frame  state %08x",
+		label, summary.frames, summary.p50Ms, summary.p99Ms, summary.maxMs, summary.gpuP50Ms, summary.gpuP99Ms, summary.allocationsPerFrame, summary.stateHash);
+	cout << line << endl;
+}
+
+// True if run is within tolerance (a fraction) of baseline
+// Frame times get some slack for noise, allocations shouldn't move at all
+bool compareReplaySummary(ReplaySummary& run, ReplaySummary& baseline, float tolerance) {
+	printReplaySummary("baseline", baseline);
+	printReplaySummary("run", run);
+
+	bool passed = true;
+	if (run.p50Ms > baseline.p50Ms * (1.0f + tolerance) + replayNoiseMs) {
+		cout << "REGRESSION: p50 frame time went from " << baseline.p50Ms << " ms to " << run.p50Ms << " ms" << endl;
+		passed = false;
+	}
+	if (run.p99Ms > baseline.p99Ms * (1.0f + tolerance) + replayNoiseMs) {
+		cout << "REGRESSION: p99 frame time went from " << baseline.p99Ms << " ms to " << run.p99Ms << " ms" << endl;
+		passed = false;
+	}
+	// Only if both runs drew something, a baseline from a simulation only run has no GPU times
+	if (run.gpuP50Ms > 0.0f && baseline.gpuP50Ms > 0.0f) {
+		if (run.gpuP50Ms > baseline.gpuP50Ms * (1.0f + tolerance) + replayNoiseMs) {
+			cout << "REGRESSION: GPU p50 frame time went from " << baseline.gpuP50Ms << " ms to " << run.gpuP50Ms << " ms" << endl;
+			passed = false;
+		}
+		if (run.gpuP99Ms > baseline.gpuP99Ms * (1.0f + tolerance) + replayNoiseMs) {
+			cout << "REGRESSION: GPU p99 frame time went from " << baseline.gpuP99Ms << " ms to " << run.gpuP99Ms << " ms" << endl;
+			passed = false;
+		}
+	}
+	if (run.allocationsPerFrame > baseline.allocationsPerFrame + 0.5f) {
+		cout << "REGRESSION: allocations per frame went from " << baseline.allocationsPerFrame << " to " << run.allocationsPerFrame << endl;
+		passed = false;
+	}
+
+	// Not a perf regression, but it means the numbers aren't measuring the same game any more
+	if (run.frames != baseline.frames || run.stateHash != baseline.stateHash) {
+		cout << "Warning: the replay didn't end in the same state as the baseline, did the game change?" << endl;
+	}
+
+	cout << (passed ? "PASSED" : "FAILED") << endl;
+	return passed;
+}
+
+// Report the run and compare/save it, returns the exe's exit code
+int finishReplay(ReplayStats& stats, const char* baselineFile, const char* writeBaselineFile, float tolerance) {
+	ReplaySummary summary = summarizeReplay(stats);
+
+	if (writeBaselineFile) {
+		writeReplaySummary(summary, writeBaselineFile);
+		cout << "Wrote " << writeBaselineFile << endl;
+	}
+
+	if (!baselineFile) {
+		printReplaySummary("run", summary);
+		return 0;
+	}
+
+	ReplaySummary baseline;
+	if (!loadReplaySummary(baseline, baselineFile)) {
+		return 1;
+	}
+	return compareReplaySummary(summary, baseline, tolerance) ? 0 : 1;
+}
+
+// No window to be had, so just run the simulation
+int runHeadlessReplay(Replay& replay, const char* baselineFile, const char* writeBaselineFile, float tolerance) {
+	cout << "No window, replaying the simulation only" << endl;
+
+	ReplayStats stats;
+	genReplayStats(stats);
+
+	resetGame();
+	unsigned int framesSinceCollided = -1;
+	for (unsigned int i = 0; i < replay.noFrames; i++) {
+		uint64_t start = profilerNow();
+		resetFrameStats();
+
+		actionsDown = packActions(replay.frames[i].input);
+		applyInput(replay.frames[i].input);
+		simulateFrame(replayDt, framesSinceCollided);
+
+		replayStatsAddFrame(stats, (float)((profilerNow() - start) / 1e6), endFrameStats().allocations);
+	}
+
+	int result = finishReplay(stats, baselineFile, writeBaselineFile, tolerance);
+	cleanup(stats);
+	return result;
+}
+
+//
+// Benchmarks
+//
+
+// --bench [file] times the engine's hot paths and writes the results as JSON, so runs
+// from two commits can be diffed. Each benchmark is warmed up, then timed over
+// benchReps repetitions, and we report the median and the median absolute deviation
+// per iteration (both hold up a lot better than mean/stddev when the OS gets in the way).
+const unsigned int benchWarmupReps = 5;
+const unsigned int benchReps = 31;
+const unsigned int maxBenchResults = 64;
+
+struct BenchResult {
+	const char* name;
+	double medianNs; // Per iteration
+	double madNs;
+	unsigned int iterations; // Per rep
+};
+
+BenchResult benchResults[maxBenchResults];
+unsigned int noBenchResults = 0;
+
+// Somewhere to put results so the compiler can't throw the work away
+volatile float benchSink;
+
+// Median of values (sorts them)
+double median(double* values, unsigned int count) {
+	sort(values, values + count);
+	return count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2.0;
+}
+
+// Time f(i) for i in [0, iterations), benchReps times over
+template<typename F>
+void runBenchmark(const char* name, unsigned int iterations, F f) {
+	double perIteration[benchReps];
+
+	for (unsigned int r = 0; r < benchWarmupReps + benchReps; r++) {
+		uint64_t start = profilerNow();
+		for (unsigned int i = 0; i < iterations; i++) {
+			f(i);
+		}
+		uint64_t end = profilerNow();
+
+		if (r >= benchWarmupReps) {
+			perIteration[r - benchWarmupReps] = (double)(end - start) / iterations;
+		}
+	}
+
+	double med = median(perIteration, benchReps);
+	for (unsigned int r = 0; r < benchReps; r++) {
+		perIteration[r] = fabs(perIteration[r] - med);
+	}
+	double mad = median(perIteration, benchReps);
+
+	if (noBenchResults < maxBenchResults) {
+		benchResults[noBenchResults++] = { name, med, mad, iterations };
+	}
+
+	char line[128];
+	snprintf(line, sizeof(line), "%-36s %12.1f ns  +- %8.1f\n", name, med, mad);
+	cout << line;
+}
+
+void writeBenchJson(const char* filename) {
+	ofstream file(filename);
+	if (!file.is_open()) {
+		cout << "File could not be opened " << filename << endl;
+		return;
+	}
+
+	file << "{\"reps\":" << benchReps << ",\"benchmarks\":[\n";
+	for (unsigned int i = 0; i < noBenchResults; i++) {
+		BenchResult& r = benchResults[i];
+		char line[256];
+		snprintf(line, sizeof(line), "{\"name\":\"%s\",\"median_ns\":%.2f,\"mad_ns\":%.2f,\"iterations\":%u}%s\n",
+			r.name, r.medianNs, r.madNs, r.iterations, i + 1 < noBenchResults ? "," : "");
+		file << line;
+	}
+	file << "]}\n";
+}
+
+// Simulation, collision, packing, mesh and file benchmarks, none of these need GL
+void runCpuBenchmarks() {
+	// Physics step
+	vec2d paddles[2] = { { 35.0f, 300.0f }, { 765.0f, 300.0f } };
+	float velocities[2] = { paddleSpeed, -paddleSpeed };
+	runBenchmark("physics/movePaddles", 100000, [&](unsigned int /*i*/) {
+		movePaddles(paddles, velocities, 2, 1.0 / 60.0, 1.0f);
+		velocities[0] = -velocities[0];
+		velocities[1] = -velocities[1];
+	});
+	benchSink = paddles[0].y;
+
+	vec2d ball = { 400.0f, 300.0f };
+	vec2d ballVel = pongVelocityInitial;
+	runBenchmark("physics/moveBall", 100000, [&](unsigned int /*i*/) {
+		moveBall(ball, ballVel, 1.0 / 60.0, 1.0f);
+		ballVel.x = -ballVel.x;
+	});
+	benchSink = ball.x;
+
+	// Collision, against a spread of spots around the window and paddles so every branch gets hit
+	const unsigned int noSpots = 256;
+	vec2d spots[noSpots];
+	for (unsigned int i = 0; i < noSpots; i++) {
+		vec2d& paddle = paddles[i % 2];
+		float fx = ((i * 37) % 64) / 63.0f - 0.5f;
+		float fy = ((i * 91) % 64) / 63.0f - 0.5f;
+		spots[i] = { paddle.x + fx * (paddleWidth + pongDiameter * 2), paddle.y + fy * (paddleHeight + pongDiameter * 2) };
+	}
+
+	runBenchmark("collision/window", 100000, [&](unsigned int i) {
+		vec2d pos = spots[i % noSpots];
+		vec2d vel = pongVelocityInitial;
+		benchSink = collideBallWithWindow(pos, vel) + vel.y;
+	});
+
+	runBenchmark("collision/paddles", 100000, [&](unsigned int i) {
+		vec2d pos = spots[i % noSpots];
+		vec2d vel = pongVelocityInitial;
+		unsigned int framesSinceCollided = -1;
+		collideBallWithPaddles(pos, vel, paddles, velocities, framesSinceCollided);
+		benchSink = vel.x + vel.y;
+	});
+
+	// Instance packing, the render queue's sort + batch for a frame's worth of submissions
+	CommandBuffer cb;
+	genCommandBuffer(cb, 4096, 4 * 1024 * 1024);
+
+	VAO fakeVAO = { 0, 0, 0, 0 };
+	RenderTables* tables = new RenderTables;
+	genRenderTables(*tables);
+	unsigned int program = registerProgram(*tables, 0);
+	unsigned int meshA = registerMesh(*tables, fakeVAO, GL_TRIANGLES, 6, maxInstancesPerMesh);
+	unsigned int meshB = registerMesh(*tables, fakeVAO, GL_TRIANGLES, 60, maxInstancesPerMesh);
+
+	RenderQueue queue;
+	genRenderQueue(queue, *tables, 4096);
+	runBenchmark("pack/renderQueue4096", 200, [&](unsigned int i) {
+		resetCommands(cb);
+		for (unsigned int j = 0; j < 4096; j++) {
+			InstanceData instance = { { (float)j, (float)i }, { 10.0f, 10.0f }, { 1.0f, 1.0f, 1.0f, 1.0f }, 0 };
+			submitDraw(queue, makeSortKey(j & 3, program, j & 1 ? meshA : meshB, 0, j), instance);
+		}
+		flushRenderQueue(queue, cb);
+	});
+	cleanup(queue);
+	delete tables;
+
+	Atlas* atlas = new Atlas;
+	genAtlas(*atlas, 256, 256);
+	int white = addWhiteSprite(*atlas);
+
+	SpriteBatch batch;
+	batch.vao = fakeVAO;
+	batch.instances = new SpriteInstance[16384];
+	batch.noInstances = 0;
+	batch.maxInstances = 16384;
+	runBenchmark("pack/sprites16384", 200, [&](unsigned int i) {
+		resetCommands(cb);
+		for (unsigned int j = 0; j < 16384; j++) {
+			drawSprite(batch, *atlas, white, { (float)j, (float)i }, { 4.0f, 4.0f }, { 1.0f, 1.0f, 1.0f, 1.0f });
+		}
+		flushSprites(batch, *atlas, 0, cb);
+	});
+
+	// Text layout for a full line of HUD text
+	Font font;
+	genFont(font, *atlas, 1);
+	TextLayer text;
+	text.batch = batch;
+	text.noItems = 0;
+	runBenchmark("pack/textLayout64", 10000, [&](unsigned int i) {
+		setText(text, 0, (i & 1) ? "CPU 16.67 MS  GPU 0.42 MS  DRAWS 4  GL CALLS 28  INSTANCES 3" : "P50 16.66  P95 16.90  P99 17.20  MAX 18.01  ALLOCS 0",
+			{ 10.0f, 10.0f }, 14.0f, { 1.0f, 1.0f, 1.0f, 1.0f });
+		layoutText(text, font, *atlas);
+	});
+	delete[] batch.instances;
+	cleanup(atlas->image);
+	delete atlas;
+
+	cleanup(cb);
+
+	// Mesh generation
+	runBenchmark("mesh/gen2DCircleArray20", 10000, [&](unsigned int /*i*/) {
+		float* vertices;
+		unsigned int* indices;
+		gen2DCircleArray(vertices, indices, 20, 0.5f);
+		benchSink = vertices[2];
+		delete[] vertices;
+		delete[] indices;
+	});
+
+	runBenchmark("mesh/gen2DCircleArray1024", 500, [&](unsigned int /*i*/) {
+		float* vertices;
+		unsigned int* indices;
+		gen2DCircleArray(vertices, indices, 1024, 0.5f);
+		benchSink = vertices[2];
+		delete[] vertices;
+		delete[] indices;
+	});
+
+	// File loading
+	if (fileExists("main.vs")) {
+		runBenchmark("file/readFile", 1000, [&](unsigned int /*i*/) {
+			benchSink = (float)readFile("main.vs").size();
+		});
+	}
+}
+
+// Different ways of getting a frame's instance data to the GPU
+// Each rep ends with a glFinish so the driver's share of the work gets counted too
+void runUploadBenchmarks() {
+	const unsigned int noInstances = 4096;
+	const GLsizeiptr size = noInstances * sizeof(InstanceData);
+	InstanceData* data = new InstanceData[noInstances];
+	memset(data, 0, size);
+
+	GLuint bo;
+	genBufferObject<InstanceData>(bo, GL_ARRAY_BUFFER, noInstances, data, GL_DYNAMIC_DRAW);
+	const unsigned int iterations = 200;
+
+	runBenchmark("upload/bufferSubData", iterations, [&](unsigned int i) {
+		glBufferSubData(GL_ARRAY_BUFFER, 0, size, data);
+		if (i + 1 == iterations) {
+			glFinish();
+		}
+	});
+
+	runBenchmark("upload/orphanThenSubData", iterations, [&](unsigned int i) {
+		glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_DYNAMIC_DRAW);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, size, data);
+		if (i + 1 == iterations) {
+			glFinish();
+		}
+	});
+
+	runBenchmark("upload/mapInvalidate", iterations, [&](unsigned int i) {
+		void* dst = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (dst) {
+			memcpy(dst, data, size);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+		}
+		if (i + 1 == iterations) {
+			glFinish();
+		}
+	});
+
+	glDeleteBuffers(1, &bo);
+	delete[] data;
+}
+
+// Runs everything, GL ones only if we can get a (hidden) context
+int runBenchmarks(const char* outFile) {
+	cout << "Running benchmarks" << endl;
+	runCpuBenchmarks();
+
+	initGLFW(3, 3);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+	GLFWwindow* window = nullptr;
+	createWindow(window, title, scrWidth, scrHeight, framebufferSizeCallback);
+	if (window && loadGlad()) {
+		runUploadBenchmarks();
+	}
+	else {
+		cout << "No GL context, skipping the upload benchmarks" << endl;
+	}
+	cleanup();
+
+	writeBenchJson(outFile);
+	cout << "Wrote " << outFile << endl;
+	return 0;
+}
+
+// --bench-scaling [file] spawns N balls and N paddles, N = 1, 2, 4 ... 2^20, and times each
+// stage of a frame per entity so we can see where the architecture stops scaling.
+// The CPU stages always run (the headless path), the GL stages only when we get a context.
+// "perObject" is the old way of doing things, one upload and one draw() per object.
+const unsigned int scalingMaxEntities = 1 << 20;
+const unsigned int scalingMaxPerObject = 1 << 16; // Past this the per-object path takes minutes
+const unsigned int scalingEntityFrames = 1 << 20; // Roughly how many entity updates to time per stage
+const unsigned int scalingMaxGlFrames = 1 << 12; // The GL stages glFinish every frame, so they get far fewer
+const unsigned int noScalingStages = 5;
+const char* scalingStageNames[noScalingStages] = { "simulation", "collision", "pack", "upload_draw", "per_object" };
+
+struct ScalingResult {
+	unsigned int n;
+	double ns[noScalingStages]; // Per entity per frame, negative if the stage didn't run
+};
+
+// Everything the scaling scene needs, all sized for scalingMaxEntities up front
+struct ScalingScene {
+	vec2d* balls;
+	vec2d* ballVelocities;
+	unsigned int* framesSinceCollided;
+	vec2d* paddles; // Pairs, left then right
+	float* paddleVelocities;
+	unsigned int noBalls;
+	unsigned int noPaddles;
+};
+
+void genScalingScene(ScalingScene& scene) {
+	scene.balls = new vec2d[scalingMaxEntities];
+	scene.ballVelocities = new vec2d[scalingMaxEntities];
+	scene.framesSinceCollided = new unsigned int[scalingMaxEntities];
+	scene.paddles = new vec2d[scalingMaxEntities + 1];
+	scene.paddleVelocities = new float[scalingMaxEntities + 1];
+	scene.noBalls = 0;
+	scene.noPaddles = 0;
+}
+
+// Spread n balls over the window and n paddles (at least a pair) down both sides
+void spawnScalingScene(ScalingScene& scene, unsigned int n) {
+	scene.noBalls = n;
+	scene.noPaddles = n < 2 ? 2 : (n + 1) & ~1u;
+
+	for (unsigned int i = 0; i < scene.noBalls; i++) {
+		scene.balls[i] = { pongDiameter + (float)((i * 7919u) % (unsigned int)(scrWidth - 2 * pongDiameter)),
+			pongDiameter + (float)((i * 104729u) % (unsigned int)(scrHeight - 2 * pongDiameter)) };
+		scene.ballVelocities[i] = { i & 1 ? -pongVelocityInitial.x : pongVelocityInitial.x, i & 2 ? -pongVelocityInitial.y : pongVelocityInitial.y };
+		scene.framesSinceCollided[i] = -1;
+	}
+
+	for (unsigned int i = 0; i < scene.noPaddles; i++) {
+		scene.paddles[i] = { i & 1 ? scrWidth - 35.0f : 35.0f, halfPaddleHeight + (float)((i / 2 * 31u) % (unsigned int)(scrHeight - paddleHeight)) };
+		scene.paddleVelocities[i] = (i / 2) & 1 ? paddleSpeed : -paddleSpeed;
+	}
+}
+
+void cleanup(ScalingScene& scene) {
+	delete[] scene.balls;
+	delete[] scene.ballVelocities;
+	delete[] scene.framesSinceCollided;
+	delete[] scene.paddles;
+	delete[] scene.paddleVelocities;
+}
+
+// One frame of each stage
+void scalingSimulate(ScalingScene& scene, double dt) {
+	movePaddles(scene.paddles, scene.paddleVelocities, scene.noPaddles, dt, 1.0f);
+	for (unsigned int i = 0; i < scene.noBalls; i++) {
+		moveBall(scene.balls[i], scene.ballVelocities[i], dt, 1.0f);
+	}
+
+	// Keep the paddles on screen by turning them around every frame
+	for (unsigned int i = 0; i < scene.noPaddles; i++) {
+		scene.paddleVelocities[i] = -scene.paddleVelocities[i];
+	}
+}
+
+void scalingCollide(ScalingScene& scene) {
+	unsigned int noPairs = scene.noPaddles / 2;
+	for (unsigned int i = 0; i < scene.noBalls; i++) {
+		unsigned char reset = collideBallWithWindow(scene.balls[i], scene.ballVelocities[i]);
+		if (reset) {
+			resetBall(scene.balls[i], scene.ballVelocities[i], reset);
+		}
+
+		unsigned int pair = i % noPairs;
+		collideBallWithPaddles(scene.balls[i], scene.ballVelocities[i], &scene.paddles[pair * 2], &scene.paddleVelocities[pair * 2], scene.framesSinceCollided[i]);
+	}
+}
+
+void scalingPack(ScalingScene& scene, RenderQueue& queue, CommandBuffer& cb, unsigned int program, unsigned int paddleMesh, unsigned int pongMesh) {
+	resetCommands(cb);
+	for (unsigned int i = 0; i < scene.noPaddles; i++) {
+		submitDraw(queue, makeSortKey(0, program, paddleMesh, 0, 0), { scene.paddles[i], { paddleWidth, paddleHeight }, paddleColors[i & 1], 0 });
+	}
+	for (unsigned int i = 0; i < scene.noBalls; i++) {
+		submitDraw(queue, makeSortKey(0, program, pongMesh, 0, 0), { scene.balls[i], { pongDiameter, pongDiameter }, pongColor, 0 });
+	}
+	flushRenderQueue(queue, cb);
+}
+
+// The old architecture, every object gets its own upload and draw call
+void scalingDrawPerObject(ScalingScene& scene, GLuint program, VAO paddleVAO, VAO pongVAO, unsigned int pongTriangles) {
+	bindShader(program);
+	for (unsigned int i = 0; i < scene.noPaddles; i++) {
+		InstanceData instance = { scene.paddles[i], { paddleWidth, paddleHeight }, paddleColors[i & 1], 0 };
+		updateData<InstanceData>(paddleVAO.instanceVBO, 0, 1, &instance);
+		draw(paddleVAO, GL_TRIANGLES, 3 * 2, GL_UNSIGNED_INT, 0);
+	}
+	for (unsigned int i = 0; i < scene.noBalls; i++) {
+		InstanceData instance = { scene.balls[i], { pongDiameter, pongDiameter }, pongColor, 0 };
+		updateData<InstanceData>(pongVAO.instanceVBO, 0, 1, &instance);
+		draw(pongVAO, GL_TRIANGLES, 3 * pongTriangles, GL_UNSIGNED_INT, 0);
+	}
+}
+
+// Time frames of f after one untimed warmup frame, in ns per entity per frame
+template<typename F>
+double timeScalingStage(unsigned int entities, unsigned int frames, F f) {
+	f();
+	uint64_t start = profilerNow();
+	for (unsigned int i = 0; i < frames; i++) {
+		f();
+	}
+	return (double)(profilerNow() - start) / ((double)frames * entities);
+}
+
+void writeScalingJson(const char* filename, ScalingResult* results, unsigned int noResults) {
+	ofstream file(filename);
+	if (!file.is_open()) {
+		cout << "File could not be opened " << filename << endl;
+		return;
+	}
+
+	file << "{\"scaling\":[\n";
+	for (unsigned int i = 0; i < noResults; i++) {
+		file << "{\"n\":" << results[i].n;
+		for (unsigned int s = 0; s < noScalingStages; s++) {
+			file << ",\"" << scalingStageNames[s] << "_ns\":";
+			if (results[i].ns[s] < 0.0) {
+				file << "null";
+			}
+			else {
+				char value[32];
+				snprintf(value, sizeof(value), "%.3f", results[i].ns[s]);
+				file << value;
+			}
+		}
+		file << "}" << (i + 1 < noResults ? "," : "") << "\n";
+	}
+	file << "]}\n";
+}
+
+int runScalingBenchmark(const char* outFile) {
+	// Hidden window for the GL stages, everything else still runs without one
+	initGLFW(3, 3);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+	GLFWwindow* window = nullptr;
+	createWindow(window, title, scrWidth, scrHeight, framebufferSizeCallback);
+	bool gl = window && loadGlad() && fileExists("main.vs") && fileExists("main.fs");
+	if (!gl) {
+		cout << "No GL context, only running the headless stages" << endl;
+	}
 
-	// Shaders
-	shaderProgram = genShaderProgram("main.vs", "main.fs");
-	setOrthographicProjection(shaderProgram, 0, scrWidth, 0, scrHeight, 0.0f, 1.0f);
+	const unsigned int pongTriangles = 20;
+	GLuint program = 0;
+	VAO paddleVAO = { 0, 0, 0, 0 };
+	VAO pongVAO = { 0, 0, 0, 0 };
+	if (gl) {
+		glViewport(0, 0, scrWidth, scrHeight);
+		program = genShaderProgram("main.vs", "main.fs");
+		setOrthographicProjection(program, 0, scrWidth, 0, scrHeight, 0.0f, 1.0f);
+		for (unsigned int i = 0; i < maxMaterials; i++) {
+			setMaterial(i, { 1.0f, 1.0f, 1.0f, 1.0f });
+		}
+		uploadMaterials(program);
 
-	//////
-	//
-	// Paddle Stuff!
-	//
-	//////
+		paddleVAO = genPaddleVAO();
+		pongVAO = genPongVAO(pongTriangles);
+	}
 
+	RenderTables* tables = new RenderTables;
+	genRenderTables(*tables);
+	unsigned int programId = registerProgram(*tables, program);
+	unsigned int paddleMeshId = registerMesh(*tables, paddleVAO, GL_TRIANGLES, 3 * 2, maxInstancesPerMesh);
+	unsigned int pongMeshId = registerMesh(*tables, pongVAO, GL_TRIANGLES, 3 * pongTriangles, maxInstancesPerMesh);
+
+	ScalingScene scene;
+	genScalingScene(scene);
+
+	// Worst case every submission ends up in the upload buffer, plus a bind, upload and draw per batch
+	const unsigned int maxSubmissions = scalingMaxEntities * 2 + 2;
+	RenderQueue queue;
+	genRenderQueue(queue, *tables, maxSubmissions);
+	CommandBuffer cb;
+	genCommandBuffer(cb, 3 * (maxSubmissions / maxInstancesPerMesh + 2) + 16, maxSubmissions * sizeof(InstanceData));
+
+	const unsigned int maxResults = 32;
+	ScalingResult results[maxResults];
+	unsigned int noResults = 0;
+
+	cout << "        N";
+	for (unsigned int s = 0; s < noScalingStages; s++) {
+		char header[32];
+		snprintf(header, sizeof(header), " %14s", scalingStageNames[s]);
+		cout << header;
+	}
+	cout << "   (ns per entity)" << endl;
 
+	for (unsigned int n = 1; n <= scalingMaxEntities && noResults < maxResults; n *= 2) {
+		ScalingResult& result = results[noResults++];
+		result.n = n;
 
-	// Everything is drawn in the form of triangles
-	// So we setup a vertex array to hold the "endpoints" of a triangle
-	// Setup vertex data
-	float paddleVertices[] = {
-	//		x		y
-			0.5f, 0.5f, // Index 0
-			-0.5f, 0.5f, // Index 1
-			-0.5f, -0.5f, // Index 2
-			0.5f, -0.5f // Index 3
-	};
+		spawnScalingScene(scene, n);
+		unsigned int entities = scene.noBalls + scene.noPaddles;
+		unsigned int frames = scalingEntityFrames / n;
+		if (frames < 3) {
+			frames = 3;
+		}
 
-	// Then this index array holds the order of vertices which tells the order of drawing
-	// Index data
-	unsigned int paddleIndices[] = {
-		0, 1, 2, 
-		2, 3, 0
-	};
+		result.ns[0] = timeScalingStage(entities, frames, [&]() { scalingSimulate(scene, 1.0 / 60.0); });
+		result.ns[1] = timeScalingStage(scene.noBalls, frames, [&]() { scalingCollide(scene); });
+		result.ns[2] = timeScalingStage(entities, frames, [&]() { scalingPack(scene, queue, cb, programId, paddleMeshId, pongMeshId); });
+
+		result.ns[3] = -1.0;
+		result.ns[4] = -1.0;
+		if (gl) {
+			// Finish inside the timing so the driver's work gets counted, not just queued
+			unsigned int glFrames = scalingMaxGlFrames / n;
+			if (glFrames < 3) {
+				glFrames = 3;
+			}
+			result.ns[3] = timeScalingStage(entities, glFrames, [&]() {
+				glClear(GL_COLOR_BUFFER_BIT);
+				executeCommands(cb);
+				glFinish();
+			});
+
+			if (n <= scalingMaxPerObject) {
+				unsigned int perObjectFrames = scalingMaxPerObject / n;
+				if (perObjectFrames < 3) {
+					perObjectFrames = 3;
+				}
+				result.ns[4] = timeScalingStage(entities, perObjectFrames, [&]() {
+					glClear(GL_COLOR_BUFFER_BIT);
+					scalingDrawPerObject(scene, program, paddleVAO, pongVAO, pongTriangles);
+					glFinish();
+				});
+			}
+		}
 
-	// Paddle Offsets
-	paddleOffsets[0] = { 35.0f, scrHeight / 2.0f };
-	paddleOffsets[1] = { scrWidth - 35.0f, scrHeight / 2.0f };
+		char line[32];
+		snprintf(line, sizeof(line), "%9u", n);
+		cout << line;
+		for (unsigned int s = 0; s < noScalingStages; s++) {
+			if (result.ns[s] < 0.0) {
+				snprintf(line, sizeof(line), " %14s", "-");
+			}
+			else {
+				snprintf(line, sizeof(line), " %14.2f", result.ns[s]);
+			}
+			cout << line;
+		}
+		cout << endl;
+	}
 
-	// Paddle Sizes
-	vec2d paddleSizes[] = {
-		paddleWidth, paddleHeight
-	};
+	writeScalingJson(outFile, results, noResults);
+	cout << "Wrote " << outFile << endl;
+
+	cleanup(cb);
+	cleanup(queue);
+	delete tables;
+	cleanup(scene);
+	if (gl) {
+		cleanup(paddleVAO);
+		cleanup(pongVAO);
+		deleteShader(program);
+	}
+	cleanup();
+	return 0;
+}
 
-	paddleVelocity[0] = 0.0f;
-	paddleVelocity[1] = 0.0f;
+//
+// Parallel Recording
+//
 
-	// Setup Paddles VAO/VBOs
-	VAO paddleVAO;
-	genVAO(&paddleVAO);
+// Recording a frame never touches GL, so it gets split into jobs and each job has its own
+// worker thread and command buffer. The GL thread hands a frame out by bumping
+// framesStarted, the workers record their part at the same time, and each one bumps its
+// framesRecorded when it's done. Once they've all caught up (the frame fence) the GL thread
+// replays the buffers in job order with executeCommandBuffers, so the frame comes out the
+// same as if one thread had recorded it all. Everything a job reads has to stay put until
+// then, which it does since the GL thread just waits.
+const unsigned int maxRecordJobs = 4;
+const char* recordThreadNames[maxRecordJobs] = { "Record 0", "Record 1", "Record 2", "Record 3" };
+
+// Records one part of the frame into cb, data is whatever it was added with
+typedef void (*RecordJob)(CommandBuffer& cb, void* data);
+
+struct RecordWorkers {
+	RecordJob jobs[maxRecordJobs];
+	void* data[maxRecordJobs];
+	CommandBuffer buffers[maxRecordJobs]; // Replayed in this order
+	thread workers[maxRecordJobs];
+	unsigned int noJobs;
+
+	atomic<unsigned int> framesStarted;
+	atomic<unsigned int> framesRecorded[maxRecordJobs];
+	atomic<bool> running;
+
+	// Workers sleep on start between frames, the GL thread sleeps on done while they record
+	mutex progressMutex;
+	condition_variable start;
+	condition_variable done;
+};
 
-	// pos VBO
-	genBufferObject<float>(paddleVAO.posVBO, GL_ARRAY_BUFFER, 2 * 4, paddleVertices, GL_STATIC_DRAW);
-	setAttPointer<float>(paddleVAO.posVBO, 0, 2, GL_FLOAT, 2, 0);
+RecordWorkers recordWorkers;
 
-	// offset VBO
-	genBufferObject<vec2d>(paddleVAO.offsetVBO, GL_ARRAY_BUFFER, 2, paddleOffsets, GL_DYNAMIC_DRAW);
-	setAttPointer<float>(paddleVAO.offsetVBO, 1, 2, GL_FLOAT, 2, 0, 1);
+void genRecordWorkers(RecordWorkers& workers) {
+	workers.noJobs = 0;
+	workers.framesStarted = 0;
+	workers.running = true;
+}
 
-	// size VBO
-	genBufferObject<vec2d>(paddleVAO.sizeVBO, GL_ARRAY_BUFFER, 1, paddleSizes, GL_STATIC_DRAW);
-	setAttPointer<float>(paddleVAO.sizeVBO, 2, 2, GL_FLOAT, 2, 0, 2);
+void recordThread(RecordWorkers* workers, unsigned int job) {
+	PROFILE_THREAD(recordThreadNames[job]);
+	samplerRegisterThread();
+
+	unsigned int frame = 0;
+	while (true) {
+		{
+			unique_lock<mutex> lock(workers->progressMutex);
+			workers->start.wait(lock, [&]() {
+				return workers->framesStarted.load(memory_order_acquire) != frame || !workers->running.load(memory_order_acquire);
+			});
+		}
+		if (workers->framesStarted.load(memory_order_acquire) == frame) {
+			break; // Stopped, and there's no frame waiting
+		}
+		frame++;
 
-	// EBO
-	genBufferObject<GLuint>(paddleVAO.EBO, GL_ELEMENT_ARRAY_BUFFER, 2 * 4, paddleIndices, GL_STATIC_DRAW);
+		PROFILE_BEGIN("record");
+		resetCommands(workers->buffers[job]);
+		workers->jobs[job](workers->buffers[job], workers->data[job]);
+		PROFILE_END();
 
-	// unbind VBO and VAO
-	unbindBuffer(GL_ARRAY_BUFFER);
-	unbindVAO();
+		// Same as the upload thread, taking the lock means the GL thread can't miss this
+		lock_guard<mutex> lock(workers->progressMutex);
+		workers->framesRecorded[job].store(frame, memory_order_release);
+		workers->done.notify_one();
+	}
+}
+
+// Add a job to every frame (after the ones already added) and start its worker
+// Call before the first recordFrame
+void addRecordJob(RecordWorkers& workers, RecordJob job, void* data, unsigned int maxCommands, unsigned int maxUploadBytes) {
+	if (workers.noJobs == maxRecordJobs) {
+		cout << "Too many record jobs, the limit is " << maxRecordJobs << endl;
+		abort();
+	}
+
+	unsigned int idx = workers.noJobs++;
+	workers.jobs[idx] = job;
+	workers.data[idx] = data;
+	genCommandBuffer(workers.buffers[idx], maxCommands, maxUploadBytes);
+	workers.framesRecorded[idx] = 0;
+	workers.workers[idx] = thread(recordThread, &workers, idx);
+}
+
+// Have the workers record a frame and wait until they all have, then the buffers are ready to replay
+void recordFrame(RecordWorkers& workers) {
+	unsigned int frame = workers.framesStarted.load(memory_order_relaxed) + 1;
+	unique_lock<mutex> lock(workers.progressMutex);
+	workers.framesStarted.store(frame, memory_order_release);
+	workers.start.notify_all();
+
+	workers.done.wait(lock, [&]() {
+		for (unsigned int i = 0; i < workers.noJobs; i++) {
+			if (workers.framesRecorded[i].load(memory_order_acquire) != frame) {
+				return false;
+			}
+		}
+		return true;
+	});
+}
+
+// Stop the workers and free their buffers
+void cleanup(RecordWorkers& workers) {
+	{
+		lock_guard<mutex> lock(workers.progressMutex);
+		workers.running.store(false, memory_order_release);
+		workers.start.notify_all();
+	}
+
+	for (unsigned int i = 0; i < workers.noJobs; i++) {
+		workers.workers[i].join();
+		cleanup(workers.buffers[i]);
+	}
+	workers.noJobs = 0;
+}
+
+// What the game's record jobs need to know about the frame, the GL thread fills it in
+// before each recordFrame
+struct FrameView {
+	// Where the scene goes, the offscreen target when we're drawing it below full size
+	bool scaled;
+	GLuint sceneFbo;
+	GLsizei sceneWidth, sceneHeight;
+
+	vec2d paddles[2]; // Where the paddles get drawn, which is where they are unless we late latch
+	double now; // Seconds, for the overlay
+	GLuint backgroundTexture; // 0 until it's loaded
+
+	SpriteBatch* spriteBatch;
+	RenderQueue* renderQueue;
+	unsigned int mainProgramId;
+	unsigned int paddleMeshId;
+	unsigned int pongMeshId;
+	GLuint spriteProgram;
+	Font* font;
+	Atlas* atlas;
+	int whiteSprite;
+};
+
+// Job 0: clear, background and the scene
+void recordScene(CommandBuffer& cb, void* data) {
+	FrameView& view = *(FrameView*)data;
+
+	if (view.scaled) {
+		cmdBindFramebuffer(cb, view.sceneFbo, view.sceneWidth, view.sceneHeight);
+	}
+
+	// Clear screen for the next frame
+	cmdGpuPassBegin(cb, "clear");
+	cmdClear(cb, 0.0f, 0.0f, 0.0f, 1.0f);
+	cmdGpuPassEnd(cb);
+
+	// Background
+	cmdGpuPassBegin(cb, "background");
+	if (view.backgroundTexture) {
+		drawImage(*view.spriteBatch, { scrWidth / 2.0f, scrHeight / 2.0f }, { (float)scrWidth, (float)scrHeight }, { 1.0f, 1.0f, 1.0f, 1.0f });
+	}
+	flushSprites(*view.spriteBatch, view.backgroundTexture, view.spriteProgram, cb);
+	cmdGpuPassEnd(cb);
+
+	// Submit Objects
+	// Order doesn't matter here, the queue sorts and batches them
+	RenderQueue& queue = *view.renderQueue;
+	submitDraw(queue, makeSortKey(0, view.mainProgramId, view.paddleMeshId, 0, 0), { view.paddles[0], { paddleWidth, paddleHeight }, paddleColors[0], 0 });
+	submitDraw(queue, makeSortKey(0, view.mainProgramId, view.paddleMeshId, 0, 0), { view.paddles[1], { paddleWidth, paddleHeight }, paddleColors[1], 0 });
+	submitDraw(queue, makeSortKey(0, view.mainProgramId, view.pongMeshId, 0, 0), { pongOffset, { pongDiameter, pongDiameter }, pongColor, 0 });
+
+	// Render Objects
+	cmdGpuPassBegin(cb, "scene");
+	flushRenderQueue(queue, cb);
+	cmdGpuPassEnd(cb);
+}
+
+// Job 1: stretching the scene back over the window, then the HUD on top at full resolution
+void recordHud(CommandBuffer& cb, void* data) {
+	FrameView& view = *(FrameView*)data;
+
+	if (view.scaled) {
+		cmdGpuPassBegin(cb, "upscale");
+		cmdBlit(cb, view.sceneFbo, view.sceneWidth, view.sceneHeight, screenFramebuffer, scrWidth, scrHeight);
+		cmdGpuPassEnd(cb);
+	}
+
+	cmdGpuPassBegin(cb, "hud");
+	flushText(hudText, *view.font, *view.atlas, view.spriteProgram, cb);
+	drawPerfOverlay(perfOverlay, *view.font, *view.atlas, view.whiteSprite, view.spriteProgram, cb, view.now);
+	cmdGpuPassEnd(cb);
+}
+
+//
+// Command Line
+//
+
+// Is flag on the command line
+bool hasArg(int argc, char** argv, const char* flag) {
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], flag) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// The value after flag, or fallback if it's not there
+const char* argValue(int argc, char** argv, const char* flag, const char* fallback) {
+	for (int i = 1; i < argc - 1; i++) {
+		if (strcmp(argv[i], flag) == 0) {
+			return argv[i + 1];
+		}
+	}
+	return fallback;
+}
+
+int main(int argc, char** argv) {
+	cout << "Hello World!" << endl;
+
+	// --bench [file] runs the microbenchmarks instead of the game
+	if (hasArg(argc, argv, "--bench")) {
+		const char* outFile = argValue(argc, argv, "--bench", "bench.json");
+		return runBenchmarks(outFile[0] == '-' ? "bench.json" : outFile);
+	}
+
+	// --bench-scaling [file] runs the entity count scaling benchmark instead of the game
+	if (hasArg(argc, argv, "--bench-scaling")) {
+		const char* outFile = argValue(argc, argv, "--bench-scaling", "scaling.json");
+		return runScalingBenchmark(outFile[0] == '-' ? "scaling.json" : outFile);
+	}
+
+	// --sample-profile [prefix] samples the whole run and writes <prefix>.folded/.txt at exit
+	bool sampling = hasArg(argc, argv, "--sample-profile");
+	const char* samplePrefix = argValue(argc, argv, "--sample-profile", "profile");
+	if (samplePrefix[0] == '-') {
+		samplePrefix = "profile";
+	}
+	if (sampling) {
+		sampling = startSamplingProfiler(997); // Prime so we don't beat against anything periodic
+	}
+
+	// --flight-budget <ms|xN> dumps the flight recorder when a frame takes longer than ms, or N
+	// times the normal frame interval (default x2)
+	const char* flightBudget = argValue(argc, argv, "--flight-budget", "x2");
+
+	// --late-latch draws the paddles with input polled just before they're submitted
+	lateLatchEnabled = hasArg(argc, argv, "--late-latch");
+
+#if MO_PROFILER
+	// --perf-counters reads hardware counters in every profiler zone, written to counters.txt at exit
+	perfCountersEnabled = hasArg(argc, argv, "--perf-counters");
+#endif
+
+	// --record <file> saves every frame's input, --replay <file> plays it back (see Replays)
+	const char* recordFile = argValue(argc, argv, "--record", nullptr);
+	const char* replayFile = argValue(argc, argv, "--replay", nullptr);
+	const char* baselineFile = argValue(argc, argv, "--baseline", nullptr);
+	const char* writeBaselineFile = argValue(argc, argv, "--write-baseline", nullptr);
+	float tolerance = (float)atof(argValue(argc, argv, "--tolerance", "10")) / 100.0f;
+
+	Replay replay;
+	genReplay(replay);
+	unsigned int replayFrame = 0;
+	if (replayFile && !loadReplay(replay, replayFile)) {
+		cleanup(replay);
+		return -1;
+	}
+
+	// Timing
+	double dt = 0.0;
+	double lastFrame = 0.0;
+
+	// --golden <dir> / --write-golden <dir> [--golden-frames a,b,c] check frames of a replay (see Headless)
+	const char* goldenDir = argValue(argc, argv, "--write-golden", argValue(argc, argv, "--golden", nullptr));
+	if (goldenDir && !replayFile) {
+		cout << "Golden images need a --replay to draw the same frames every time" << endl;
+	}
+	else if (goldenDir) {
+		genGoldenImages(goldenImages, goldenDir, hasArg(argc, argv, "--write-golden"), argValue(argc, argv, "--golden-frames", "1,60,300"));
+	}
+
+	// --headless [osmesa|egl] draws without a display (see Headless)
+	int headlessApi = 0;
+	if (hasArg(argc, argv, "--headless")) {
+		headlessApi = strcmp(argValue(argc, argv, "--headless", "osmesa"), "egl") == 0 ? GLFW_EGL_CONTEXT_API : GLFW_OSMESA_CONTEXT_API;
+	}
+
+	// Init (I am using OpenGL version 3.3
+	initGLFW(3, 3, headlessApi);
+
+	// Replays run offscreen
+	if (replayFile) {
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	}
+
+	// Create the window
+	GLFWwindow* window = nullptr;
+	createWindow(window, title, scrWidth, scrHeight, framebufferSizeCallback);
+	if (!window && headlessApi) {
+		cout << "Headless context could not be created, is " << (headlessApi == GLFW_EGL_CONTEXT_API ? "EGL" : "OSMesa") << " installed?" << endl;
+	}
+	if (!window && replayFile) {
+		cleanup();
+		int result = runHeadlessReplay(replay, baselineFile, writeBaselineFile, tolerance);
+		if (goldenImages.dir) {
+			cout << "No GL context, so no golden images" << endl;
+			result = 1;
+		}
+		cleanup(replay);
+		return result;
+	}
+	if (!window) {
+		cout << "Window could not be created" << endl;
+		cleanup();
+		return -1;
+	}
+
+	// Keys come in as events and get turned into actions (see Input Events and Action Map)
+	glfwSetKeyCallback(window, keyCallback);
+	bindDefaultActions(actionMap);
+	if (loadBindings(actionMap, bindingsFile)) {
+		cout << "Loaded bindings from " << bindingsFile << endl;
+	}
+
+	// Load Glad
+	if (!loadGlad()) {
+		cout << "Glad could ot be loaded" << endl;
+		cleanup();
+		return -1;
+	}
+
+	// --vsync off|on|adaptive (default adaptive), --fps <rate> to limit the frame rate (-1 for
+	// no limit even with vsync off), --max-queued-frames <n> (default 2, 0 for no limit)
+	const char* vsyncArg = argValue(argc, argv, "--vsync", "adaptive");
+	VsyncMode vsync = strcmp(vsyncArg, "off") == 0 ? VSYNC_OFF : strcmp(vsyncArg, "on") == 0 ? VSYNC_ON : VSYNC_ADAPTIVE;
+	double targetFps = atof(argValue(argc, argv, "--fps", "0"));
+	unsigned int maxQueuedFrames = (unsigned int)atoi(argValue(argc, argv, "--max-queued-frames", "2"));
+
+	// Replays measure how long frames take, not the monitor's refresh rate
+	ReplayStats replayStats;
+	genReplayStats(replayStats);
+	if (replayFile) {
+		vsync = VSYNC_OFF;
+		targetFps = -1.0;
+	}
+	genFramePacer(framePacer, vsync, targetFps, maxQueuedFrames);
+
+	// A headless context (or hidden window) might not have a framebuffer we can draw into and read back
+	if (headlessApi || replayFile) {
+		genOffscreenScreen(scrWidth, scrHeight);
+	}
+
+	glViewport(0, 0, scrWidth, scrHeight);
+
+	// Shaders
+	shaderProgram = genShaderProgram("main.vs", "main.fs");
+	setOrthographicProjection(shaderProgram, 0, scrWidth, 0, scrHeight, 0.0f, 1.0f);
+
+	// Materials (0 is the default, plain white)
+	for (unsigned int i = 0; i < maxMaterials; i++) {
+		setMaterial(i, { 1.0f, 1.0f, 1.0f, 1.0f });
+	}
+	uploadMaterials(shaderProgram);
+
+	// Sprite shader
+	GLuint spriteProgram = genShaderProgram("sprite.vs", "sprite.fs");
+	setOrthographicProjection(spriteProgram, 0, scrWidth, 0, scrHeight, 0.0f, 1.0f);
+
+	// Sprites can be see through
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	// Textures and buffers get made on the upload thread from here on (see Resource Uploads)
+	genResourceUploader(resourceUploader, window);
+
+	//////
+	//
+	// Paddle Stuff!
+	//
+	//////
+
+
+
+	// Paddles and ball start in the middle
+	resetGame();
+
+	// Setup Paddles VBOs, they get made while we get on with the rest of the setup and the VAO once they're back
+	MeshUpload paddleMesh;
+	uploadMesh(resourceUploader, paddleMesh, paddleVertices, 2 * 4, paddleIndices, 3 * 2);
 
-	
 	//////
 	//
 	// Pong Ball Stuff!
 	//
 	//////
 
+	unsigned int numOfTtriangles = 20;
+
+	// The offset and size get sent per instance so the shader can scale the generic vertices to anything we want
+	// Setup Pong Ball VBOs, same as the paddles
 	float* pongVertices;
 	unsigned int* pongIndices;
-	unsigned int numOfTtriangles = 20;
 	gen2DCircleArray(pongVertices, pongIndices, numOfTtriangles, 0.5f);
+	MeshUpload pongMesh;
+	uploadMesh(resourceUploader, pongMesh, pongVertices, 2 * (numOfTtriangles + 1), pongIndices, 3 * numOfTtriangles);
+	delete[] pongVertices;
+	delete[] pongIndices;
 
-	// These two arrays will allow the shader to scale the size of the generic vertices to anything we want
-	// Offsets
-	pongOffset = { scrWidth / 2.0f, scrHeight / 2.0f };
+	//////
+	//
+	// Sprite Stuff!
+	//
+	//////
 
-	// Sizes
-	vec2d pongSizes[] = {
-		pongDiameter, pongDiameter
-	};
+	// Every image gets packed into this one atlas at load time
+	Atlas* atlas = new Atlas;
+	genAtlas(*atlas, 1024, 1024);
 
-	// Setup Pong Ball VAO/VBOs
-	VAO pongVAO;
-	genVAO(&pongVAO);
+	int whiteSprite = addWhiteSprite(*atlas);
 
-	// Pos VBO
-	// The vertices are 2 per incides with 4 total indices, and we use static draw since the data wont likely change
-	// to help ease the GPU's troubles :)
-	genBufferObject<float>(pongVAO.posVBO, GL_ARRAY_BUFFER, 2 * (numOfTtriangles + 1), pongVertices, GL_STATIC_DRAW);
-	setAttPointer<float>(pongVAO.posVBO, 0, 2, GL_FLOAT, 2, 0);
+	// Font glyphs go in the same atlas so text and sprites share a texture
+	Font font;
+	genFont(font, *atlas, 4);
 
-	// Offset VBO
-	// The offset array is 1 by 2, and we use dyanmic draw to tell the GPU that this will likely change every frame
-	genBufferObject<vec2d>(pongVAO.offsetVBO, GL_ARRAY_BUFFER, 1, &pongOffset, GL_DYNAMIC_DRAW);
-	setAttPointer<float>(pongVAO.offsetVBO, 1, 2, GL_FLOAT, 2, 0, 1);
+	// Optional art, we just skip anything that isn't there
+	// The background is big, so it loads in the background and shows up once it's ready
+	unsigned int backgroundUpload = 0;
+	GLuint backgroundTexture = 0;
+	if (fileExists("background.tga")) {
+		backgroundUpload = uploadTextureFile(resourceUploader, "background.tga");
+	}
 
-	// Size VBO
-	genBufferObject<vec2d>(pongVAO.sizeVBO, GL_ARRAY_BUFFER, 1, pongSizes, GL_DYNAMIC_DRAW);
-	setAttPointer<float>(pongVAO.sizeVBO, 2, 2, GL_FLOAT, 2, 0, 1);
+	genAtlasTexture(*atlas);
+
+	SpriteBatch spriteBatch;
+	genSpriteBatch(spriteBatch, 65536);
+
+	genTextLayer(hudText, 1024);
+	genPerfOverlay(perfOverlay);
+	genFlightRecorder(flightRecorder, flightBudget);
+	uint64_t frameStart = profilerNow();
+
+	// Frame time distributions for the whole session
+	genHistogram(cpuHistogram, "cpu_us");
+	genHistogram(gpuHistogram, "gpu_us");
+	genHistogram(presentHistogram, "present_us");
+	time_t sessionStart = time(nullptr);
+	uint64_t lastPresent = 0;
+	unsigned int lastGpuResolved = 0;
+
+	// The meshes have to be there for the first frame, they were queued first so they come back first
+	UploadResult upload;
+	while (!(meshUploaded(paddleMesh) && meshUploaded(pongMesh)) && pollUpload(resourceUploader, upload, true)) {
+		if (!receiveMeshUpload(paddleMesh, upload)) {
+			receiveMeshUpload(pongMesh, upload);
+		}
+	}
+	if (!meshUploaded(paddleMesh) || !meshUploaded(pongMesh)) {
+		cout << "Meshes could not be uploaded" << endl;
+		cleanup(resourceUploader);
+		cleanup();
+		return -1;
+	}
+	VAO paddleVAO = paddleMesh.vao;
+	VAO pongVAO = pongMesh.vao;
 
-	// EBO
-	genBufferObject<unsigned int>(pongVAO.EBO, GL_ELEMENT_ARRAY_BUFFER, 3 * (numOfTtriangles), pongIndices, GL_STATIC_DRAW);
+	// Register everything with the render queue
+	unsigned int mainProgramId = registerProgram(renderTables, shaderProgram);
+	registerProgram(renderTables, spriteProgram);
+	unsigned int paddleMeshId = registerMesh(renderTables, paddleVAO, GL_TRIANGLES, 3 * 2, maxInstancesPerMesh);
+	unsigned int pongMeshId = registerMesh(renderTables, pongVAO, GL_TRIANGLES, 3 * numOfTtriangles, maxInstancesPerMesh);
 
-	// Unbind VBO and VAO
-	unbindBuffer(GL_ARRAY_BUFFER);
-	unbindVAO();
+	// Time since last collision
+	unsigned int framesSinceCollided = -1;
 
-	// Resets ball to center when a player scores
-	unsigned char pongReset = 0;
+	// --no-idle draws every frame even when nothing's changed, and golden frames have to get drawn
+	idleEnabled = !hasArg(argc, argv, "--no-idle") && !goldenImages.dir;
 
-	// Var to check distance of Pong to paddle
-	vec2d pongToPaddle;
+	// --capture <file.y4m|file.tga> [--capture-fps n] records every frame, which means we can't skip any
+	if (hasArg(argc, argv, "--capture")) {
+		const char* captureFile = argValue(argc, argv, "--capture", "capture.y4m");
+		unsigned int captureFps = max(atoi(argValue(argc, argv, "--capture-fps", "60")), 1);
+		genFrameCapture(frameCapture, captureFile[0] == '-' ? "capture.y4m" : captureFile, scrWidth, scrHeight, captureFps, replayFile != nullptr);
+		idleEnabled = false;
+	}
+	glfwSetWindowRefreshCallback(window, windowRefreshCallback);
+	bool lastFrameIdle = false;
+	uint32_t lastDrawnHash = 0;
 
-	// Bool for collision checking
-	bool collided = false;
+	// Render pass timings on the GPU
+	genGpuTimer();
 
-	// Time since last collision
-	unsigned int framesSinceCollided = -1;
-	unsigned int framesToAllowCollision = 7;
+	// --dynamic-resolution [budget ms] scales the scene to fit the GPU's frame time
+	if (hasArg(argc, argv, "--dynamic-resolution")) {
+		genDynamicResolution(dynamicResolution, scrWidth, scrHeight, atof(argValue(argc, argv, "--dynamic-resolution", "0")));
+	}
+
+	// Input to photon latency (needs the GPU timer's clock offset)
+	genLatencyTracker(latencyTracker);
+
+	// Draws for the frame get submitted here and sorted/batched by the scene job
+	RenderQueue renderQueue;
+	genRenderQueue(renderQueue, renderTables, 1024);
+
+	// The frame gets recorded by worker threads, one buffer each, and replayed on this (the GL) thread
+	FrameView frameView;
+	frameView.spriteBatch = &spriteBatch;
+	frameView.renderQueue = &renderQueue;
+	frameView.mainProgramId = mainProgramId;
+	frameView.paddleMeshId = paddleMeshId;
+	frameView.pongMeshId = pongMeshId;
+	frameView.spriteProgram = spriteProgram;
+	frameView.font = &font;
+	frameView.atlas = atlas;
+	frameView.whiteSprite = whiteSprite;
+	genRecordWorkers(recordWorkers);
+	addRecordJob(recordWorkers, recordScene, &frameView, 256, 4 * 1024 * 1024);
+	addRecordJob(recordWorkers, recordHud, &frameView, 256, 1024 * 1024);
 
 	displayScore(); //Initial score -> 0 - 0
 
 	// Render Loop
+	PROFILE_THREAD("main");
+
 	while (!glfwWindowShouldClose(window)) {
+		PROFILE_FRAME();
+		PROFILE_ZONE("frame");
+
 		//Update the time
 		dt = glfwGetTime() - lastFrame;
 		lastFrame += dt;
 
-		////
-		// Physiccs
-		////
+		// Stats for the frame that just finished (idle frames are meant to be slow, so they don't count)
+		FrameStats lastStats = endFrameStats();
+		if (!lastFrameIdle) {
+			perfOverlayAddFrame(perfOverlay, (float)(dt * 1000.0), lastStats);
+			flightRecorderAddFrame(flightRecorder, (float)(dt * 1000.0), actionsDown, hashGameState(), lastFrame);
+		}
+		if (replayFile && replayFrame > 0) {
+			replayStatsAddFrame(replayStats, (float)((profilerNow() - frameStart) / 1e6), lastStats.allocations);
+		}
+		resetFrameStats();
+		frameStart = profilerNow();
+		flightRecorderBeginFrame(flightRecorder, frameStart);
 
-		// Input
-		processInput(window, dt);
+		// Window size changes from the last frame's events
+		applyResize();
 
-		//Update Paddle Position
-		paddleOffsets[0].y += paddleVelocity[0] * dt * gameSpeed;
-		paddleOffsets[1].y += paddleVelocity[1] * dt * gameSpeed;
+		// Replay's over
+		if (replayFile && replayFrame == replay.noFrames) {
+			break;
+		}
 
-		// Update Pong Position
-		pongOffset.x += pongVelocity.x * dt * gameSpeed;
-		pongOffset.y += pongVelocity.y * dt * gameSpeed;
+		// Replays always step by the same amount so they play out the same every time
+		if (replayFile) {
+			dt = replayDt;
+		}
 
 		////
-		// Check collision
+		// Physiccs
 		////
 
-		// Pong Ball Collision
-		//Collision with window 
-		// Collided with top and bottom of window
-		if (pongOffset.y - pongRadius <= 0 || pongOffset.y + pongRadius >= scrHeight) {
-			pongVelocity.y *= -1;
+		// Input
+		PROFILE_BEGIN("processInput");
+		InputSnapshot input = replayFile ? replay.frames[replayFrame++].input : gatherInput(window, lastFrame - dt, lastFrame);
+		actionsDown = packActions(input);
+		applyInput(input);
+		if (recordFile) {
+			replayRecord(replay, dt, input);
 		}
+		PROFILE_END();
 
-		// Collided with left and right window
-		if (pongOffset.x - pongRadius <= 0) {
-			//cout << "Right Player Scored a Point!" << endl;
-			rightScore++;
-			pongReset = 1;
-		}
+		simulateFrame(dt, framesSinceCollided);
 
-		else if (pongOffset.x + pongRadius >= scrWidth) {
-			//cout << "Left Player Scored a Point!" << endl;
-			leftScore++;
-			pongReset = 2;
+		// Pick up anything the upload thread's finished (replays wait, so every run draws the same frames)
+		while (pollUpload(resourceUploader, upload, replayFile != nullptr)) {
+			if (upload.id == backgroundUpload) {
+				backgroundTexture = upload.handle;
+				redrawRequested = true;
+			}
 		}
 
-		// Resets pong's pos and velocity
-		if (pongReset) {
-			pongOffset.x = scrWidth / 2.0f;
-			pongOffset.y = scrHeight / 2.0f;
-
-			pongVelocity.x = pongReset == 1 ? pongVelocityInitial.x : -pongVelocityInitial.x;
-			pongVelocity.y = pongVelocityInitial.y;
-			
-			displayScore();
-
-			pongReset = false;
+		// Nothing new to show, so wait for something to happen instead of drawing it again
+		uint32_t sceneHash = hashGameState();
+		lastFrameIdle = !replayFile && !frameNeedsDrawing(window, sceneHash, lastDrawnHash);
+		if (lastFrameIdle) {
+			PROFILE_BEGIN("idle");
+			idleWait();
+			PROFILE_END();
+			lastPresent = 0; // The gap isn't a present interval
+			continue;
 		}
+		lastDrawnHash = sceneHash;
+		redrawRequested = false;
 
+		////
+		// Graphics
+		////
 
-		if (framesSinceCollided != -1) {
-			framesSinceCollided++;
-		}
-
-		if (framesSinceCollided >= framesToAllowCollision || framesSinceCollided == -1) {
-			// Paddle Collision with Pong ball
-			// Chceck which paddle it is
-			int paddleIndex = 0;
-			if (pongOffset.x > scrHeight / 2.0f) {
-				paddleIndex++;
+		// Record the frame
+		PROFILE_BEGIN("record");
+
+		// The scene goes into the offscreen target when we're drawing it below full size
+		updateDynamicResolution(dynamicResolution);
+		frameView.scaled = dynamicResolutionActive(dynamicResolution);
+		frameView.sceneFbo = dynamicResolution.fbo;
+		frameView.sceneWidth = renderWidth(dynamicResolution);
+		frameView.sceneHeight = renderHeight(dynamicResolution);
+		frameView.backgroundTexture = backgroundTexture;
+		frameView.now = lastFrame;
+
+		// Where the paddles get drawn, which is where they are unless we late latch
+		frameView.paddles[0] = paddleOffsets[0];
+		frameView.paddles[1] = paddleOffsets[1];
+		if (lateLatchEnabled && !replayFile) {
+			PROFILE_BEGIN("lateLatch");
+			float latched[maxPlayers];
+			lateLatchPaddles(lastFrame, glfwGetTime(), latched);
+			for (unsigned int i = 0; i < 2; i++) {
+				frameView.paddles[i].y = min(max(frameView.paddles[i].y + latched[i], paddleBoundary), scrHeight - paddleBoundary);
 			}
+			PROFILE_END();
+		}
 
-			// We are usig the paddle index from above to check which paddle it is likely to collide with
-			// Then over here we are checking the distance of the Pong ball to the paddle
-			pongToPaddle = { abs(pongOffset.x - paddleOffsets[paddleIndex].x), abs(pongOffset.y - paddleOffsets[paddleIndex].y) };
-
-			if ((pongToPaddle.x <= halfPaddleWidth + pongRadius) && (pongToPaddle.y <= halfPaddleHeight + pongRadius)) {
-				
-				collided = false;
-				
-				// Collided along the LENGTH of the Paddle
-				if (pongToPaddle.x <= halfPaddleWidth && pongToPaddle.x >= (halfPaddleWidth - pongRadius)) {
-					collided = true;
-					pongVelocity.x *= -1; // Flipping the x only
-				}
-
-				// Collided along the WIDTH of the Paddle
-				else if (pongToPaddle.y <= halfPaddleHeight && pongToPaddle.y >= (halfPaddleHeight - pongRadius)) {
-					collided = true;
-					pongVelocity.y *= -1; // Flipping the y only
-				}
-
-				// Collided on an edge case (like literally the edge of the paddle is an edge case lol)
-				if ((pongToPaddle.x - halfPaddleWidth) * (pongToPaddle.x - halfPaddleWidth)
-					+ (pongToPaddle.y - halfPaddleHeight) * (pongToPaddle.y - halfPaddleHeight)
-					<= (pongRadius * pongRadius) && (!collided)) {
-					// Pythagorean theorm
-					// Squared distance is < radius^2
-					// therefore distance is less than radius -> We'll treat as length collision since I can't be bothered lol
-
-					collided = true;
-
-					float signedDifference = paddleOffsets[paddleIndex].x - pongOffset.x;
-					if (paddleIndex == 0) {
-						// Reversing the difference if right paddle, lefts needs to be +ve
-						signedDifference *= -1;
-					}
-					if ((pongToPaddle.y - halfPaddleHeight) <= (signedDifference - halfPaddleWidth)) {
-						pongVelocity.x *= -1; // More of a length collision
-					}
-					else {
-						pongVelocity.y *= -1; // Otherwise more of a width collision
-					}
-
-				}
-
-				if (collided) {
-					// Increase velocity of pong ball upong collision
-					float k = 0.5f;
-					pongVelocity.x *= 1.1;
-					pongVelocity.y += k * 1 * paddleVelocity[paddleIndex];
+		recordFrame(recordWorkers);
+		PROFILE_END(); // record
+
+		// Replay it
+		PROFILE_BEGIN("executeCommands");
+		gpuTimerBeginFrame();
+		executeCommandBuffers(recordWorkers.buffers, recordWorkers.noJobs);
+		gpuTimerEndFrame();
+		PROFILE_END();
+		uint64_t submitTime = profilerNow();
+
+		// Start reading this frame back (if we're capturing) before it gets swapped away
+		captureFrame(frameCapture);
+		if (replayFile) {
+			goldenCheckFrame(goldenImages, replayFrame);
+		}
 
-					framesSinceCollided = 0;
-				}
+		// GPU results show up a couple of frames late, so only record when there's a new one
+		if (gpuTimer.resolvedFrames != lastGpuResolved) {
+			histogramRecord(gpuHistogram, (uint64_t)(gpuTimer.frameMs * 1000.0));
+			if (replayFile) {
+				replayStatsAddGpuFrame(replayStats, (float)gpuTimer.frameMs);
 			}
+			lastGpuResolved = gpuTimer.resolvedFrames;
 		}
 
-		
+		if (histogramPrintRequested) {
+			printFrameHistograms();
+			printLatencyHistograms(latencyTracker);
+			histogramPrintRequested = false;
+		}
 
+		if (dumpCommandsRequested) {
+			dumpCommands(recordWorkers.buffers, recordWorkers.noJobs, "commands.txt");
+			dumpCommandsRequested = false;
+		}
 
+#if MO_PROFILER
+		if (dumpTraceRequested) {
+			unsigned int frame = profilerFrame.load();
+			profilerDumpChromeTrace("trace.json", frame > traceDumpFrames ? frame - traceDumpFrames : 0, frame);
+			dumpTraceRequested = false;
+		}
+#endif
 
-		////
-		// Graphics
-		////
+		// Everything up to handing the frame over
+		histogramRecord(cpuHistogram, (profilerNow() - frameStart) / 1000);
 
-		// Clear screen for the next frame
-		clearScreen();
+		// Swap Frames
+		PROFILE_BEGIN("newFrame");
+		newFrame(window);
+		PROFILE_END();
 
-		// update
-		updateData<vec2d>(paddleVAO.offsetVBO, 0, 2, paddleOffsets);
-		updateData<vec2d>(pongVAO.offsetVBO, 0, 1, &pongOffset);
+		uint64_t present = profilerNow();
+		if (lastPresent) {
+			histogramRecord(presentHistogram, (present - lastPresent) / 1000);
+		}
+		lastPresent = present;
 
-		// Render Objects
-		bindShader(shaderProgram);
-		draw(paddleVAO, GL_TRIANGLES, 3 * 2, GL_UNSIGNED_INT, 0, 2);
-		draw(pongVAO, GL_TRIANGLES, 3 * numOfTtriangles, GL_UNSIGNED_INT, 0);
+		// Fence the frame so we can tell when it's on screen
+		latencyEndFrame(latencyTracker, submitTime);
+	}
 
-		// Swap Frames
-		newFrame(window);
+	// Frame time and latency summary for the session, --export-histograms [file] saves the full distributions
+	printFrameHistograms();
+	printLatencyHistograms(latencyTracker);
+	if (latencyTracker.dropped) {
+		cout << latencyTracker.dropped << " frames took too long to signal (or their fence failed) and weren't counted for latency" << endl;
+	}
+	if (hasArg(argc, argv, "--export-histograms")) {
+		const char* histogramFile = argValue(argc, argv, "--export-histograms", "histograms.json");
+
+		HdrHistogram* latencyHistograms[noActions * 2 + 1];
+		unsigned int noLatencyHistograms = 0;
+		latencyHistograms[noLatencyHistograms++] = &latencyTracker.submitToPhoton;
+		for (unsigned int a = 0; a < noActions; a++) {
+			for (unsigned int e = 0; e < 2; e++) {
+				latencyHistograms[noLatencyHistograms++] = &latencyTracker.inputToPhoton[a][e];
+			}
+		}
+		exportFrameHistograms(histogramFile[0] == '-' ? "histograms.json" : histogramFile, sessionStart, latencyHistograms, noLatencyHistograms);
 	}
 
 	// Cleanup Memory
+	cleanup(perfOverlay);
+	cleanup(hudText);
+	cleanup(spriteBatch);
+	cleanup(*atlas);
+	delete atlas;
+	cleanup(renderQueue);
+	cleanup(recordWorkers);
+	cleanup(frameCapture);
+	cleanup(flightRecorder);
+	cleanup(resourceUploader);
+	glDeleteTextures(1, &backgroundTexture);
+	cleanupGpuTimer();
+	cleanup(dynamicResolution);
+	cleanupLatencyTracker(latencyTracker);
+	cleanupFramePacer(framePacer);
 	cleanup(paddleVAO);
 	cleanup(pongVAO);
 	deleteShader(shaderProgram);
+	deleteShader(spriteProgram);
+	cleanupOffscreenScreen();
 	cleanup();
 
-	return 0;
+	int result = 0;
+	if (recordFile) {
+		saveReplay(replay, recordFile);
+		cout << "Recorded " << replay.noFrames << " frames to " << recordFile << endl;
+	}
+	if (replayFile) {
+		result = finishReplay(replayStats, baselineFile, writeBaselineFile, tolerance);
+		if (finishGoldenImages(goldenImages)) {
+			result = 1;
+		}
+	}
+	cleanup(replayStats);
+	cleanup(replay);
+
+	if (sampling) {
+		stopSamplingProfiler();
+		writeSamplingReport(samplePrefix);
+	}
+
+#if MO_PROFILER
+	if (perfCountersEnabled) {
+		profilerWriteCounterReport("counters.txt");
+	}
+#endif
+
+	return result;
 }
\ No newline at end of file
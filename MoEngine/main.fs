@@ -1,7 +1,13 @@
 #version 330 core
 
+in vec4 vertexColor;
+flat in uint material;
+
+// Material tints, indexed per instance (size has to match maxMaterials)
+uniform vec4 materials[64];
+
 out vec4 color;
 
 void main() {
-	color = vec4(1.0);
+	color = vertexColor * materials[material];
 }
\ No newline at end of file
@@ -3,9 +3,16 @@
 layout (location = 0) in vec2 pos;
 layout (location = 1) in vec2 offset;
 layout (location = 2) in vec2 size;
+layout (location = 3) in vec4 instanceColor;
+layout (location = 4) in uint instanceMaterial;
 
 uniform mat4 projection;
 
+out vec4 vertexColor;
+flat out uint material;
+
 void main() {
 	gl_Position = projection * vec4((pos * size) + offset, 0.0, 1.0);
+	vertexColor = instanceColor;
+	material = instanceMaterial;
 }
\ No newline at end of file
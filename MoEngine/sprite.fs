@@ -0,0 +1,12 @@
+#version 330 core
+
+in vec2 uv;
+in vec4 vertexColor;
+
+uniform sampler2D atlas;
+
+out vec4 color;
+
+void main() {
+	color = texture(atlas, uv) * vertexColor;
+}
\ No newline at end of file
@@ -0,0 +1,21 @@
+#version 330 core
+
+layout (location = 0) in vec2 pos;
+layout (location = 1) in vec2 offset;
+layout (location = 2) in vec2 size;
+layout (location = 3) in vec2 uvMin;
+layout (location = 4) in vec2 uvMax;
+layout (location = 5) in vec4 instanceColor;
+
+uniform mat4 projection;
+
+out vec2 uv;
+out vec4 vertexColor;
+
+void main() {
+	gl_Position = projection * vec4((pos * size) + offset, 0.0, 1.0);
+
+	// pos goes from -0.5 to 0.5, so shift it to 0 to 1 to pick the spot in the sprite's rect
+	uv = mix(uvMin, uvMax, pos + 0.5);
+	vertexColor = instanceColor;
+}
\ No newline at end of file